@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <cmath>
+#include <numbers>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "runtime.h"
+#include "differential.h"
+
+// expt8_benchmark [frames] [threads]
+// renders each scene for a fixed number of frames and prints one json object per scene and thread count,
+// then the speedup of the optimized backend over the reference on randomized frames
+
+namespace {
+
+constexpr size_t width = expt8::classic_profile::width;
+constexpr size_t height = expt8::classic_profile::height;
+constexpr size_t warmup_frames = 8;
+
+struct scene {
+	std::string_view name;
+	void (*setup)(expt8::runtime &runtime);
+	void (*step)(expt8::runtime &runtime, size_t frame);
+};
+
+void fill_patterns(expt8::runtime &runtime) {
+	std::mt19937 mt(1);
+	std::uniform_int_distribution<> d4(0, 3);
+	std::vector<expt8::pixel_t> pixels(expt8::pattern::num_pixels * expt8::pattern_table::num_patterns);
+	for (auto &pixel : pixels) pixel = static_cast<expt8::pixel_t>(d4(mt));
+	// tile 0 stays transparent so an empty screen is really empty
+	std::fill_n(pixels.begin(), expt8::pattern::num_pixels, 0);
+	runtime.write_pattern(0, std::span{ pixels });
+	runtime.write_pattern(1, std::span{ pixels });
+
+	expt8::color_t colors[] = { 0x0F, 0x21, 0x26, 0x30, 0x0F, 0x29, 0x13, 0x17, 0x0F, 0x11, 0x16, 0x27, 0x0F, 0x2A, 0x1A, 0x0A };
+	runtime.set_background_palette(colors);
+	runtime.set_sprite_palette(colors);
+}
+
+void fill_background(expt8::runtime &runtime) {
+	std::mt19937 mt(2);
+	std::uniform_int_distribution<> d256(1, 255), d4(0, 3);
+	for (size_t name_table = 0; name_table < expt8::background_plane::num_name_tables; ++name_table) {
+		for (size_t y = 0; y < expt8::tile_table::height; ++y) {
+			for (size_t x = 0; x < expt8::tile_table::width; ++x) {
+				runtime.set_tile(name_table, x, y, static_cast<expt8::index_t>(d256(mt)));
+				runtime.set_tile_palette(name_table, x, y, static_cast<expt8::index_t>(d4(mt)));
+			}
+		}
+	}
+}
+
+// 8 sprites on each of 8 lines, moving so the bins are rebuilt every frame
+void place_sprites(expt8::runtime &runtime, size_t frame) {
+	for (size_t i = 0; i < expt8::sprite_plane::num_sprites; ++i) {
+		auto x = static_cast<expt8::coordinate_t>((i % 8) * 30 + frame % 16);
+		auto y = static_cast<expt8::coordinate_t>((i / 8) * 28 + 8);
+		runtime.set_sprite(i, x, y, static_cast<expt8::index_t>(1 + i), static_cast<expt8::index_t>(i % 4), static_cast<expt8::attribute_t>(i % 3 == 0 ? expt8::sprite::priority_back : 0));
+	}
+}
+
+void no_step(expt8::runtime &, size_t) {}
+
+const scene scenes[] = {
+	{
+		"empty",
+		[](expt8::runtime &runtime) {},
+		no_step,
+	},
+	{
+		"background",
+		[](expt8::runtime &runtime) { fill_background(runtime); },
+		no_step,
+	},
+	{
+		"sprites_64_on_8_lines",
+		[](expt8::runtime &runtime) { fill_background(runtime); },
+		place_sprites,
+	},
+	{
+		"scroll_wrap",
+		[](expt8::runtime &runtime) { fill_background(runtime); },
+		[](expt8::runtime &runtime, size_t frame) {
+			// crosses both wrap points every few frames
+			auto x = static_cast<expt8::coordinate_t>(frame * 37 % expt8::background_plane::full_pixel_width);
+			auto y = static_cast<expt8::coordinate_t>(frame * 13 % expt8::background_plane::full_pixel_height);
+			runtime.set_scroll(x, y);
+		},
+	},
+	{
+		"hblank_callback",
+		[](expt8::runtime &runtime) {
+			fill_background(runtime);
+			auto &ppu = runtime.ppu();
+			ppu.set_callback([&ppu](int x, int y) {
+				auto s = std::sin(std::numbers::pi * 2 * (static_cast<double>(y) / static_cast<double>(height)));
+				ppu.set_scroll(static_cast<expt8::coordinate_t>(s * 32), 0);
+			}, expt8::picture_processing_unit::hblank);
+		},
+		place_sprites,
+	},
+	{
+		"always_callback",
+		[](expt8::runtime &runtime) {
+			fill_background(runtime);
+			runtime.ppu().set_callback([](int x, int y) {}, expt8::picture_processing_unit::always);
+		},
+		place_sprites,
+	},
+};
+
+struct statistics {
+	double mean = 0;
+	double variance = 0;
+	double min = 0;
+	double max = 0;
+};
+
+statistics measure(const std::vector<double> &samples) {
+	statistics result;
+	if (samples.empty()) return result;
+
+	result.min = samples.front();
+	result.max = samples.front();
+	for (auto sample : samples) {
+		result.mean += sample;
+		result.min = std::min(result.min, sample);
+		result.max = std::max(result.max, sample);
+	}
+	result.mean /= static_cast<double>(samples.size());
+
+	for (auto sample : samples) result.variance += (sample - result.mean) * (sample - result.mean);
+	if (samples.size() > 1) result.variance /= static_cast<double>(samples.size() - 1);
+	return result;
+}
+
+void run(const scene &it, size_t num_frames, size_t num_threads) {
+	using clock = std::chrono::steady_clock;
+
+	expt8::runtime runtime;
+	runtime.set_render_threads(num_threads);
+	fill_patterns(runtime);
+	it.setup(runtime);
+
+	std::vector<expt8::color_t> framebuffer(width * height);
+	std::vector<double> samples;
+	samples.reserve(num_frames);
+	for (size_t frame = 0; frame < warmup_frames + num_frames; ++frame) {
+		it.step(runtime, frame);
+		auto start = clock::now();
+		runtime.render_picture(std::span{ framebuffer }, width, height);
+		auto end = clock::now();
+		if (frame >= warmup_frames) samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+	}
+
+	auto stats = measure(samples);
+	auto pixels_per_second = (stats.mean > 0) ? (static_cast<double>(width * height) * 1e9 / stats.mean) : 0.0;
+	printf(
+		"{\"scene\":\"%.*s\",\"threads\":%zu,\"frames\":%zu,\"width\":%zu,\"height\":%zu,"
+		"\"ns_per_frame\":%.1f,\"ns_variance\":%.1f,\"ns_stddev\":%.1f,\"ns_min\":%.1f,\"ns_max\":%.1f,\"pixels_per_second\":%.0f}\n",
+		static_cast<int>(it.name.size()), it.name.data(), num_threads, num_frames, width, height,
+		stats.mean, stats.variance, std::sqrt(stats.variance), stats.min, stats.max, pixels_per_second
+	);
+	fflush(stdout);
+}
+
+// false when the backends disagree, the timings of a wrong picture mean nothing
+bool run_backends(size_t num_frames, size_t num_threads) {
+	expt8::runtime::ppu_type settings;
+	settings.set_render_threads(num_threads);
+	auto result = expt8::compare_backends(settings, num_frames);
+	auto num_timed_frames = result.num_frames - result.num_shared_frames;
+	printf(
+		"{\"scene\":\"backends\",\"threads\":%zu,\"frames\":%zu,\"timed_frames\":%zu,\"width\":%zu,\"height\":%zu,"
+		"\"reference_ns_per_frame\":%.1f,\"optimized_ns_per_frame\":%.1f,\"speedup\":%.2f,\"mismatch\":%s}\n",
+		num_threads, result.num_frames, num_timed_frames, width, height,
+		(num_timed_frames > 0) ? (result.reference_seconds * 1e9 / static_cast<double>(num_timed_frames)) : 0.0,
+		(num_timed_frames > 0) ? (result.optimized_seconds * 1e9 / static_cast<double>(num_timed_frames)) : 0.0,
+		result.speedup(), result.found ? "true" : "false"
+	);
+	fflush(stdout);
+	return !result.found;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	size_t num_frames = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 0;
+	if (num_frames == 0) num_frames = 600;
+
+	size_t max_threads = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 0;
+	if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (auto &it : scenes) {
+		run(it, num_frames, 1);
+		if (max_threads > 1) run(it, num_frames, max_threads);
+	}
+
+	bool matched = run_backends(num_frames, 1);
+	if (max_threads > 1) matched = run_backends(num_frames, max_threads) && matched;
+	return matched ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+
+#include "runtime.h"
+
+// checks the optimized render backend against the reference, for tools and benchmarks,
+// kept out of runtime.h so the runtime does not compile it
+
+namespace expt8 {
+
+// the first pixel where the optimized backend left the reference, and the time both took
+struct backend_difference {
+	size_t num_frames = 0;
+	bool found = false;
+	size_t frame = 0;
+	coordinate_t x = 0;
+	coordinate_t y = 0;
+	color_t reference = 0;
+	color_t optimized = 0;
+	double reference_seconds = 0;
+	double optimized_seconds = 0;
+
+	// frames both backends drew through render_pixels, compared but left out of the seconds
+	size_t num_shared_frames = 0;
+
+	double speedup() const { return (optimized_seconds > 0) ? (reference_seconds / optimized_seconds) : 0; }
+};
+
+// renders randomized states, callbacks and raster writes through both backends until the first mismatch,
+// the optimized side takes the render settings of settings (threads, path, cache, incremental, sprites)
+template<typename Profile>
+backend_difference compare_backends(const basic_picture_processing_unit<Profile> &settings, size_t num_frames, uint32_t seed = 0) {
+	using ppu_type = basic_picture_processing_unit<Profile>;
+	using clock = std::chrono::steady_clock;
+	constexpr auto width = Profile::width;
+	constexpr auto height = Profile::height;
+
+	// the same calls in the same order on both sides,
+	// quiet frames keep scroll and palettes and make no or only a few dirty writes,
+	// so incremental rendering and the background cache get to reuse the previous frame
+	auto randomize = [](ppu_type &it, std::mt19937 &mt, bool quiet) {
+		std::uniform_int_distribution<> d4(0, 3), d100(0, 99), d256(0, 255);
+		std::uniform_int_distribution<coordinate_t> dx(-16, static_cast<coordinate_t>(width) + 16), dy(-16, static_cast<coordinate_t>(height) + 16);
+		if (quiet) {
+			it.clear_raster_log();
+			if (d4(mt) == 0) return;
+			for (int i = d4(mt); i >= 0; --i) {
+				it.set_tile(d4(mt), d256(mt) % tile_table::width, d256(mt) % tile_table::height, static_cast<index_t>(d256(mt)));
+				it.set_tile_palette(d4(mt), d256(mt) % tile_table::width, d256(mt) % tile_table::height, static_cast<index_t>(d4(mt)));
+			}
+			if (d4(mt) == 0) {
+				std::vector<pixel_t> pixels(pattern::num_pixels);
+				for (auto &pixel : pixels) pixel = static_cast<pixel_t>(d4(mt));
+				it.write_pattern(d4(mt), d256(mt), std::span{ pixels });
+			}
+			if (d4(mt) != 0) {
+				auto i = static_cast<size_t>(d256(mt)) % it.get_sprite_count();
+				it.set_sprite(i, dx(mt), dy(mt), static_cast<index_t>(d256(mt)), static_cast<index_t>(d4(mt)), static_cast<attribute_t>(d256(mt) & 0x0F));
+			}
+			return;
+		}
+		if (d100(mt) < 20) {
+			std::vector<pixel_t> pixels(pattern::num_pixels * (1 + d4(mt)));
+			for (auto &pixel : pixels) pixel = static_cast<pixel_t>(d4(mt));
+			it.write_pattern(d4(mt), d256(mt), std::span{ pixels });
+		}
+		for (size_t i = 0; i < palette::num_colors * background_plane::num_palettes; ++i) {
+			it.set_background_palette(i / palette::num_colors, i % palette::num_colors, static_cast<color_t>(d256(mt) & 0x3F));
+			it.set_sprite_palette(i / palette::num_colors, i % palette::num_colors, static_cast<color_t>(d256(mt) & 0x3F));
+		}
+		for (int i = d100(mt); i > 0; --i) {
+			it.set_tile(d4(mt), d256(mt) % tile_table::width, d256(mt) % tile_table::height, static_cast<index_t>(d256(mt)));
+			it.set_tile_palette(d4(mt), d256(mt) % tile_table::width, d256(mt) % tile_table::height, static_cast<index_t>(d4(mt)));
+		}
+		for (size_t i = 0; i < it.get_sprite_count(); ++i) {
+			if (d4(mt) == 0) it.set_sprite(i, dx(mt), dy(mt), static_cast<index_t>(d256(mt)), static_cast<index_t>(d4(mt)), static_cast<attribute_t>(d256(mt) & 0x0F));
+		}
+		it.set_scroll(dx(mt) * 4, dy(mt) * 4);
+		it.clear_raster_log();
+		if (d4(mt) == 0) {
+			for (int i = d4(mt); i >= 0; --i) it.record_scroll(dy(mt), dx(mt), dy(mt));
+		}
+	};
+
+	// each side gets its own generator seeded alike, and is called at the same dots
+	auto make_callback = [](ppu_type &it, uint32_t callback_seed) {
+		return [&it, mt = std::mt19937(callback_seed)](int, int) mutable {
+			std::uniform_int_distribution<> d100(0, 99), d256(0, 255);
+			if (d100(mt) < 2) it.set_scroll(d256(mt), d256(mt));
+			if (d100(mt) < 2) it.set_sprite(d256(mt) % it.get_sprite_count(), d256(mt), d256(mt), static_cast<index_t>(d256(mt)), static_cast<index_t>(d256(mt) & 3), static_cast<attribute_t>(d256(mt) & 0x0F));
+			if (d100(mt) < 2) it.set_tile(d256(mt) & 3, d256(mt) % tile_table::width, d256(mt) % tile_table::height, static_cast<index_t>(d256(mt)));
+		};
+	};
+
+	ppu_type reference;
+	reference.set_render_backend(render_backend::reference);
+	reference.set_render_path(render_path::scalar);
+	ppu_type ppu;
+	ppu.set_render_path(settings.get_render_path());
+	ppu.set_render_threads(settings.get_render_threads());
+	ppu.set_background_cache(settings.get_background_cache());
+	ppu.set_incremental(settings.get_incremental());
+	for (auto it : { &reference, &ppu }) {
+		it->set_sprite_count(settings.get_sprite_count());
+		it->set_sprite_limit(settings.get_sprite_limit());
+	}
+
+	std::mt19937 reference_mt(seed);
+	std::mt19937 optimized_mt(seed);
+	std::vector<color_t> reference_frame(width * height);
+	std::vector<color_t> optimized_frame(width * height);
+
+	backend_difference result;
+	for (size_t frame = 0; frame < num_frames; ++frame) {
+		// runs of four busy frames, one per callback timing, then four quiet ones without callbacks
+		static constexpr attribute_t timings[] = { 0, ppu_type::vblank, ppu_type::hblank, ppu_type::always };
+		bool quiet = ((frame / std::size(timings)) % 2) != 0;
+		auto timing = quiet ? attribute_t{ 0 } : timings[frame % std::size(timings)];
+
+		randomize(reference, reference_mt, quiet);
+		randomize(ppu, optimized_mt, quiet);
+
+		auto callback_seed = static_cast<uint32_t>(seed + frame);
+		reference.set_callback(timing ? typename ppu_type::callback(make_callback(reference, callback_seed)) : typename ppu_type::callback{}, timing);
+		ppu.set_callback(timing ? typename ppu_type::callback(make_callback(ppu, callback_seed)) : typename ppu_type::callback{}, timing);
+
+		// every dot callbacks and mid-line raster writes run the reference code on both sides
+		bool shared = (timing == ppu_type::always) || ppu.get_raster_log().mid_line;
+
+		auto start = clock::now();
+		reference.render(reference_frame, width, height);
+		auto middle = clock::now();
+		ppu.render(optimized_frame, width, height);
+		auto end = clock::now();
+
+		if (shared) {
+			++result.num_shared_frames;
+		} else {
+			result.reference_seconds += std::chrono::duration<double>(middle - start).count();
+			result.optimized_seconds += std::chrono::duration<double>(end - middle).count();
+		}
+		result.num_frames = frame + 1;
+
+		auto [reference_it, optimized_it] = std::mismatch(reference_frame.begin(), reference_frame.end(), optimized_frame.begin());
+		if (reference_it != reference_frame.end()) {
+			auto position = static_cast<size_t>(reference_it - reference_frame.begin());
+			result.found = true;
+			result.frame = frame;
+			result.x = static_cast<coordinate_t>(position % width);
+			result.y = static_cast<coordinate_t>(position / width);
+			result.reference = *reference_it;
+			result.optimized = *optimized_it;
+			break;
+		}
+	}
+	return result;
+}
+
+} // namespace expt8
@@ -11,6 +11,8 @@
 #include <random>
 #include <cmath>
 #include <numbers>
+#include <chrono>
+#include <string>
 
 #include <SDL.h>
 
@@ -18,22 +20,31 @@
 #include <m3_env.h>
 
 #include "runtime.h"
+#include "differential.h"
 
 #define EXPT8_WASM (0)
+#define EXPT8_PIPELINE (0)
+#define EXPT8_WIDESCREEN (0)
 
 namespace {
 
-constexpr int logical_width = 256;
-constexpr int logical_height = 240;
+#if EXPT8_WIDESCREEN
+using console_profile = expt8::widescreen_profile;
+#else
+using console_profile = expt8::classic_profile;
+#endif
+using console_runtime = expt8::basic_runtime<console_profile>;
+
+constexpr int logical_width = console_profile::width;
+constexpr int logical_height = console_profile::height;
 constexpr int default_scale = 2;
 constexpr int default_width = (logical_width * default_scale);
 constexpr int default_height = (logical_height * default_scale);
 constexpr Uint64 fps = 60;
 constexpr Uint64 ms_frame = (1000LLU / fps);
+constexpr int turbo_steps = 8;
 constexpr uint32_t memory_size = (1024 * 64) * 2;
 
-using framebuffer = std::array<expt8::pixel_t, logical_width * logical_height>;
-
 constexpr uint8_t input_right = 0b00000001;
 constexpr uint8_t input_left = 0b00000010;
 constexpr uint8_t input_down = 0b00000100;
@@ -48,6 +59,11 @@ uint8_t input_state = 0;
 
 SDL_Renderer *renderer = nullptr;
 
+console_runtime *console = nullptr;
+
+// from whichever ppu rendered the frame on screen
+const expt8::collision_report *collisions = nullptr;
+
 auto inline print_sdl_error() {
 	return SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s", SDL_GetError());
 }
@@ -123,6 +139,92 @@ m3ApiRawFunction(wasm_press) {
 	m3ApiReturn(on);
 }
 
+m3ApiRawFunction(wasm_detect_collisions) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, enabled);
+	if (console) console->set_collision_detection(enabled != 0);
+	m3ApiReturn(0);
+}
+
+// (y << 16) | x of the first sprite 0 hit, -1 without one
+m3ApiRawFunction(wasm_sprite_zero_hit) {
+	m3ApiReturnType(int);
+	int hit = -1;
+	if (collisions && collisions->sprite_zero_hit) {
+		hit = ((collisions->sprite_zero_y & 0xFFFF) << 16) | (collisions->sprite_zero_x & 0xFFFF);
+	}
+	m3ApiReturn(hit);
+}
+
+m3ApiRawFunction(wasm_sprite_collision) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, id);
+	int flags = 0;
+	if (collisions && (id >= 0) && (id < collisions->flags.size())) {
+		flags = collisions->flags[id];
+	}
+	m3ApiReturn(flags);
+}
+
+m3ApiRawFunction(wasm_collision_pairs) {
+	m3ApiReturnType(int);
+	m3ApiReturn(collisions ? static_cast<int>(collisions->pairs.size()) : 0);
+}
+
+// (a << 16) | b, -1 when out of range
+m3ApiRawFunction(wasm_collision_pair) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, index);
+	int pair = -1;
+	if (collisions && (index >= 0) && (index < collisions->pairs.size())) {
+		auto [a, b] = collisions->pairs[index];
+		pair = (a << 16) | b;
+	}
+	m3ApiReturn(pair);
+}
+
+m3ApiRawFunction(wasm_pattern_banks) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, num);
+	int banks = 0;
+	if (console) {
+		if (num > 0) console->set_pattern_banks(num);
+		banks = static_cast<int>(console->ppu().get_pattern_banks());
+	}
+	m3ApiReturn(banks);
+}
+
+// 64 pixels per pattern, one pixel per byte
+m3ApiRawFunction(wasm_write_pattern_bank) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, bank);
+	m3ApiGetArg(int, tile);
+	m3ApiGetArgMem(uint8_t *, src);
+	m3ApiGetArg(int32_t, size);
+	if (size > 0) m3ApiCheckMem(src, size);
+	if (console && (bank >= 0) && (tile >= 0) && (size > 0)) {
+		console->write_pattern_bank(bank, tile, std::span<uint8_t>(src, static_cast<size_t>(size)));
+	}
+	m3ApiReturn(0);
+}
+
+m3ApiRawFunction(wasm_map_pattern_bank) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, window);
+	m3ApiGetArg(int, bank);
+	if (console && (window >= 0) && (bank >= 0)) console->map_pattern_bank(window, bank);
+	m3ApiReturn(0);
+}
+
+m3ApiRawFunction(wasm_record_pattern_bank) {
+	m3ApiReturnType(int);
+	m3ApiGetArg(int, y);
+	m3ApiGetArg(int, window);
+	m3ApiGetArg(int, bank);
+	if (console && (window >= 0) && (bank >= 0)) console->record_pattern_bank(y, window, bank);
+	m3ApiReturn(0);
+}
+
 std::filesystem::path current_wasm;
 
 IM3Environment environment = nullptr;
@@ -212,6 +314,15 @@ bool setup_wasm(const std::filesystem::path &file_path) {
 			m3_LinkRawFunction(module, "*", "draw_rect", "i(iiii)", wasm_draw_rect);
 			m3_LinkRawFunction(module, "*", "input", "i(i)", wasm_input);
 			m3_LinkRawFunction(module, "*", "press", "i(i)", wasm_press);
+			m3_LinkRawFunction(module, "*", "detect_collisions", "i(i)", wasm_detect_collisions);
+			m3_LinkRawFunction(module, "*", "sprite_zero_hit", "i()", wasm_sprite_zero_hit);
+			m3_LinkRawFunction(module, "*", "sprite_collision", "i(i)", wasm_sprite_collision);
+			m3_LinkRawFunction(module, "*", "collision_pairs", "i()", wasm_collision_pairs);
+			m3_LinkRawFunction(module, "*", "collision_pair", "i(i)", wasm_collision_pair);
+			m3_LinkRawFunction(module, "*", "pattern_banks", "i(i)", wasm_pattern_banks);
+			m3_LinkRawFunction(module, "*", "write_pattern_bank", "i(ii*i)", wasm_write_pattern_bank);
+			m3_LinkRawFunction(module, "*", "map_pattern_bank", "i(ii)", wasm_map_pattern_bank);
+			m3_LinkRawFunction(module, "*", "record_pattern_bank", "i(iii)", wasm_record_pattern_bank);
 			m3_FindFunction(&test, runtime, "test");
 			m3_FindFunction(&test_memcpy, runtime, "test_memcpy");
 			m3_FindFunction(&test_counter_get, runtime, "test_counter_get");
@@ -269,22 +380,206 @@ bool setup_wasm(const std::filesystem::path &file_path) {
 	return succeeded;
 }
 
-} // namespace
+// one frame of the cartridge, false when it has no update
+bool update_cartridge() {
+	if (!update) return false;
+	m3_CallV(update);
+	int result = 0;
+	m3_GetResultsV(update, &result);
+	return true;
+}
 
-int main(int argc, char **argv) {
+// hardware colors
+constexpr Uint32 rgb_colors[] = {
+	0x757575, 0x271B8F, 0x0000AB, 0x47009F, 0x8F0077, 0xAB0013, 0xA70000, 0x7F0B00,
+	0x432F00, 0x004700, 0x005100, 0x003F17, 0x1B3F5F, 0x000000, 0x000000, 0x000000,
+
+	0xBCBCBC, 0x0073EF, 0x233BEF, 0x8300F3, 0xBF00BF, 0xE7005B, 0xDB2B00, 0xCB4F0F,
+	0x8B7300, 0x009700, 0x00AB00, 0x00933B, 0x00838B, 0x000000, 0x000000, 0x000000,
+
+	0xFFFFFF, 0x3FBFFF, 0x5F73FF, 0xA78BFD, 0xF77BFF, 0xFF77B7, 0xFF7763, 0xFF9B3B,
+	0xF3BF3F, 0x83D313, 0x4FDF4B, 0x58F898, 0x00EBDB, 0x757575, 0x000000, 0x000000,
+
+	0xFFFFFF, 0xABE7FF, 0xC7D7FF, 0xD7CBFF, 0xFFC7FF, 0xFFC7DB, 0xFFBFB3, 0xFFDBAB,
+	0xFFE7A3, 0xE3FFA3, 0xABF3BF, 0xB3FFCF, 0x9FFFF3, 0xBCBCBC, 0x000000, 0x000000,
+};
+
+// a table per display effect in the given pixel format
+std::unique_ptr<expt8::palette_bank> make_palettes(Uint32 pixel_format) {
+	auto *format = SDL_AllocFormat(pixel_format);
+	auto palettes = std::make_unique<expt8::palette_bank>(std::span{ rgb_colors }, [format](Uint8 r, Uint8 g, Uint8 b) {
+		return SDL_MapRGB(format, r, g, b);
+	});
+	SDL_FreeFormat(format);
+	return palettes;
+}
+
+struct options {
+	std::filesystem::path cartridge = "boot.wasm";
+	size_t differential_frames = 0;
+	size_t headless_frames = 0;
+	std::filesystem::path input_script;
+	std::filesystem::path record_script;
+	std::filesystem::path image;
+};
+
+// expt8 [cartridge] [--differential [frames]] [--headless [frames]] [--input script] [--record script] [--image file.bmp]
+options parse_options(int argc, char **argv) {
+	options result;
+	auto count = [&](int &i, size_t fallback) {
+		size_t value = 0;
+		if ((i + 1) < argc) {
+			char *end = nullptr;
+			value = std::strtoul(argv[i + 1], &end, 10);
+			if ((end != argv[i + 1]) && (*end == '\0')) ++i;
+		}
+		return (value > 0) ? value : fallback;
+	};
+	auto path = [&](int &i) {
+		return ((i + 1) < argc) ? std::filesystem::path(argv[++i]) : std::filesystem::path();
+	};
+	for (int i = 1; i < argc; ++i) {
+		auto arg = std::string_view(argv[i]);
+		if (arg == "--differential") {
+			result.differential_frames = count(i, 1000);
+		} else if (arg == "--headless") {
+			result.headless_frames = count(i, 600);
+		} else if (arg == "--input") {
+			result.input_script = path(i);
+		} else if (arg == "--record") {
+			result.record_script = path(i);
+		} else if (arg == "--image") {
+			result.image = path(i);
+		} else if (!arg.starts_with("-")) {
+			result.cartridge = arg;
+		}
+	}
+	return result;
+}
+
+// "<frame> <input bits in hex>" per line, held until the next line, # starts a comment
+std::vector<std::pair<size_t, uint8_t>> load_input_script(const std::filesystem::path &file_path) {
+	std::vector<std::pair<size_t, uint8_t>> script;
+	std::ifstream file(file_path);
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line.starts_with("#")) continue;
+		size_t frame = 0;
+		unsigned int bits = 0;
+		if (sscanf(line.c_str(), "%zu %x", &frame, &bits) == 2) script.emplace_back(frame, static_cast<uint8_t>(bits));
+	}
+	std::stable_sort(script.begin(), script.end(), [](auto &a, auto &b) { return a.first < b.first; });
+	return script;
+}
+
+// fnv-1a over the visible pixels of each row
+uint64_t hash_pixels(const SDL_Surface *surface) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	auto row_size = static_cast<size_t>(surface->w) * surface->format->BytesPerPixel;
+	for (int y = 0; y < surface->h; ++y) {
+		auto *row = static_cast<const uint8_t *>(surface->pixels) + static_cast<size_t>(y) * surface->pitch;
+		for (size_t i = 0; i < row_size; ++i) {
+			hash = (hash ^ row[i]) * 0x100000001B3ULL;
+		}
+	}
+	return hash;
+}
+
+// steps the cartridge and renders as fast as possible into a software surface, no display needed,
+// prints "frame <n> <hash>" per frame and the frame rate at the end
+int run_headless(const options &opts) {
+	// without a cartridge to step there is nothing to check, a soak test must not pass on blank frames
 #if EXPT8_WASM
-	{
-		std::filesystem::path file_path = "boot.wasm";
-		for (int i = 1; i < argc; ++i) {
-			auto arg = std::string_view(argv[i]);
-			if (arg.starts_with("-")) continue;
-			file_path = arg;
+	if (!update) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s: no update to run", opts.cartridge.string().c_str());
+		return 1;
+	}
+#else
+	SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--headless needs a build with EXPT8_WASM");
+	return 1;
+#endif
+
+	auto *surface = SDL_CreateRGBSurfaceWithFormat(0, logical_width, logical_height, 32, SDL_PIXELFORMAT_RGB888);
+	if (surface == nullptr) {
+		print_sdl_error();
+		return 1;
+	}
+	renderer = SDL_CreateSoftwareRenderer(surface);
+	if (renderer == nullptr) {
+		print_sdl_error();
+		SDL_FreeSurface(surface);
+		return 1;
+	}
+
+	console_runtime runtime;
+	::console = &runtime;
+	::collisions = &runtime.ppu().get_collisions();
+
+	auto palettes = make_palettes(surface->format->format);
+	expt8::palette_bank::effect effect;
+	auto script = load_input_script(opts.input_script);
+	size_t next_input = 0;
+	::input_state = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t frame = 0; frame < opts.headless_frames; ++frame) {
+		::input_state_last = ::input_state;
+		for (; (next_input < script.size()) && (script[next_input].first <= frame); ++next_input) {
+			::input_state = script[next_input].second;
 		}
-		if (!setup_wasm(file_path)) {
-			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "wasm3 error");
+
+		SDL_LockSurface(surface);
+		runtime.render_picture(expt8::rgb32_output{ surface->pixels, static_cast<size_t>(surface->pitch), palettes->get(effect) }, logical_width, logical_height);
+		SDL_UnlockSurface(surface);
+
+		update_cartridge();
+		SDL_RenderFlush(renderer);
+
+		printf("frame %zu %016llx\n", frame, static_cast<unsigned long long>(hash_pixels(surface)));
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("frames %zu seconds %.3f fps %.1f\n", opts.headless_frames, seconds, (seconds > 0) ? (opts.headless_frames / seconds) : 0.0);
+
+	if (!opts.image.empty() && (SDL_SaveBMP(surface, opts.image.string().c_str()) < 0)) {
+		print_sdl_error();
+	}
+
+	::console = nullptr;
+	::collisions = nullptr;
+	SDL_DestroyRenderer(renderer);
+	renderer = nullptr;
+	SDL_FreeSurface(surface);
+	return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	auto opts = parse_options(argc, argv);
+
+	// checks the optimized backend against the reference and exits
+	if (opts.differential_frames > 0) {
+		console_runtime::ppu_type settings;
+		settings.set_render_threads(std::thread::hardware_concurrency());
+		auto result = expt8::compare_backends(settings, opts.differential_frames);
+		if (result.found) {
+			printf("frame %zu: first mismatch at (%d, %d), reference %d, optimized %d\n", result.frame, result.x, result.y, result.reference, result.optimized);
 		}
+		printf("%zu frames, reference %.3f s, optimized %.3f s, %.2fx over %zu timed frames\n", result.num_frames, result.reference_seconds, result.optimized_seconds, result.speedup(), result.num_frames - result.num_shared_frames);
+		return result.found ? 1 : 0;
+	}
+
+#if EXPT8_WASM
+	if (!setup_wasm(opts.cartridge)) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "wasm3 error");
 	}
 #endif
+
+	if (opts.headless_frames > 0) {
+		auto result = run_headless(opts);
+		finalize_m3();
+		return result;
+	}
 	
 	if (auto init = SDL_Init(SDL_INIT_EVERYTHING); init < 0) {
 		print_sdl_error();
@@ -317,7 +612,9 @@ int main(int argc, char **argv) {
 			KeyboardState.resize(Num);
 		}
 
-		expt8::runtime runtime;
+		console_runtime runtime;
+		::console = &runtime;
+		::collisions = &runtime.ppu().get_collisions();
 
 		// dummy bg color
 		runtime.set_background_color(0x00);
@@ -372,31 +669,23 @@ int main(int argc, char **argv) {
 			runtime.set_background_palette(pal);
 #endif
 		}
+		// three screens side by side, streamed into the name tables as the view scrolls
+		expt8::world_map world(expt8::tile_table::width * 3, expt8::tile_table::height);
 		{
 			int p = 0;
 			for (int y = 0; y < expt8::tile_table::height; ++y) {
 				for (int x = 0; x < expt8::tile_table::width; ++x) {
-					runtime.set_tile(0, x, y, x % 2);
-					if ((x % 2 == 0) && (y % 2 == 0)) runtime.set_tile_palette(0, x, y, p++ % 2);
-				}
-			}
-		}
-		{
-			int p = 0;
-			for (int y = 0; y < expt8::tile_table::height; ++y) {
-				for (int x = 0; x < expt8::tile_table::width; ++x) {
-					runtime.set_tile(1, x, y, (x == 0 || x == (expt8::tile_table::width - 1) || y == 0 || y == (expt8::tile_table::height - 1)) ? 2 : 0);
-				}
-			}
-		}
-		{
-			int p = 0;
-			for (int y = 0; y < expt8::tile_table::height; ++y) {
-				for (int x = 0; x < expt8::tile_table::width; ++x) {
-					runtime.set_tile(2, x, y, (x == 0 || x == (expt8::tile_table::width - 1) || y == 0 || y == (expt8::tile_table::height - 1)) ? 3 : 0);
+					bool edge = (x == 0 || x == (expt8::tile_table::width - 1) || y == 0 || y == (expt8::tile_table::height - 1));
+					world.set_tile(x, y, x % 2);
+					if ((x % 2 == 0) && (y % 2 == 0)) world.set_tile_palette(x, y, p++ % 2);
+					world.set_tile(expt8::tile_table::width + x, y, edge ? 2 : 0);
+					world.set_tile(expt8::tile_table::width * 2 + x, y, edge ? 3 : 0);
 				}
 			}
 		}
+		expt8::basic_world_stream<console_profile> world_stream;
+		world_stream.set_map(&world);
+		world_stream.update(runtime.ppu(), 0, 0);
 
 		// dummy sprite
 		{
@@ -431,64 +720,38 @@ int main(int argc, char **argv) {
 			runtime.set_sprite_palette(0, 0x00, 0x15, 0x29, 0x30);
 		}
 
-		framebuffer fb{ 0 };
-		std::array<Uint32, 256> palette{ 0 };
-
-		// dummy framebuffer
+		// screen format, the first plain 32 or 16 bit format the renderer takes natively
+		Uint32 screen_format = SDL_PIXELFORMAT_RGBA8888;
 		{
-			for (int y = 0; y < logical_height; ++y) {
-				for (int x = 0; x < logical_width; ++x) {
-					fb[y * logical_width + x] = x / 16 + y / 16 * 16;
+			SDL_RendererInfo info{};
+			SDL_GetRendererInfo(renderer, &info);
+			for (Uint32 i = 0; i < info.num_texture_formats; ++i) {
+				auto format = info.texture_formats[i];
+				if (SDL_ISPIXELFORMAT_FOURCC(format) || SDL_ISPIXELFORMAT_INDEXED(format)) continue;
+				if ((SDL_BYTESPERPIXEL(format) == 4) || (SDL_BYTESPERPIXEL(format) == 2)) {
+					screen_format = format;
+					break;
 				}
 			}
 		}
 
-		// palette
+		// palette, a table per display effect in the screen format
+		std::unique_ptr<expt8::palette_bank> palettes;
 		{
-			constexpr Uint32 rgb_colors[] = {
-				0x757575, 0x271B8F, 0x0000AB, 0x47009F, 0x8F0077, 0xAB0013, 0xA70000, 0x7F0B00,
-				0x432F00, 0x004700, 0x005100, 0x003F17, 0x1B3F5F, 0x000000, 0x000000, 0x000000,
-
-				0xBCBCBC, 0x0073EF, 0x233BEF, 0x8300F3, 0xBF00BF, 0xE7005B, 0xDB2B00, 0xCB4F0F,
-				0x8B7300, 0x009700, 0x00AB00, 0x00933B, 0x00838B, 0x000000, 0x000000, 0x000000,
-
-				0xFFFFFF, 0x3FBFFF, 0x5F73FF, 0xA78BFD, 0xF77BFF, 0xFF77B7, 0xFF7763, 0xFF9B3B,
-				0xF3BF3F, 0x83D313, 0x4FDF4B, 0x58F898, 0x00EBDB, 0x757575, 0x000000, 0x000000,
-
-				0xFFFFFF, 0xABE7FF, 0xC7D7FF, 0xD7CBFF, 0xFFC7FF, 0xFFC7DB, 0xFFBFB3, 0xFFDBAB,
-				0xFFE7A3, 0xE3FFA3, 0xABF3BF, 0xB3FFCF, 0x9FFFF3, 0xBCBCBC, 0x000000, 0x000000,
-			};
-			constexpr size_t num_colors = sizeof(rgb_colors) / sizeof(rgb_colors[0]);
-
-			auto *format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
-			auto pal = std::span{ palette.data(), num_colors };
-
-			for (int i = 0; i < pal.size(); ++i) {
-				auto color = rgb_colors[i];
-				pal[i] = SDL_MapRGB(format, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
-			}
+			palettes = make_palettes(screen_format);
 		}
 
-		auto *screen = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, logical_width, logical_height);
+		auto *screen = SDL_CreateTexture(renderer, screen_format, SDL_TEXTUREACCESS_STREAMING, logical_width, logical_height);
 
-		bool grayscale = false;
+#if EXPT8_PIPELINE
+		expt8::basic_render_pipeline<console_profile> pipeline(logical_width, logical_height);
+#endif
+
+		expt8::palette_bank::effect effect;
+		bool screen_ready = false;
 		bool fullscreen = false;
 		int raster = 0;
 
-		runtime.ppu().set_callback(
-			[&](int x, int y) {
-				if (y < 32 || x < logical_width / 2) {
-					runtime.set_scroll(0, 0);
-
-				} else {
-					auto base = (y + raster) % logical_height;
-					auto s = std::sin(std::numbers::pi * 2 * (static_cast<double>(base) / static_cast<double>(logical_height - 1))) ;
-					runtime.set_scroll(s * 32, 0);
-				}
-			},
-			0//expt8::picture_processing_unit::always
-		);
-
 		std::random_device rd;
 		std::mt19937 mt(rd());
 		std::uniform_int_distribution<> distw(0, logical_width - expt8::pattern::width);
@@ -514,6 +777,10 @@ int main(int argc, char **argv) {
 		Uint64 lag = 0;
 		int max_skip = 2;
 
+		std::ofstream record;
+		if (!opts.record_script.empty()) record.open(opts.record_script);
+		size_t frame = 0;
+
 		bool running = true;
 		while (running) {
 			auto current_ticks = SDL_GetPerformanceCounter();
@@ -554,6 +821,12 @@ int main(int argc, char **argv) {
 				fullscreen = !fullscreen;
 			}
 
+			if (!KeyboardState[SDL_SCANCODE_F9] && CurrentKeyboardState[SDL_SCANCODE_F9]) {
+				effect.grayscale = !effect.grayscale;
+				screen_ready = false;
+			}
+
+			::input_state_last = ::input_state;
 			::input_state = 0;
 			if (CurrentKeyboardState[SDL_SCANCODE_RIGHT]) ::input_state |= input_right;
 			if (CurrentKeyboardState[SDL_SCANCODE_LEFT])  ::input_state |= input_left;
@@ -563,17 +836,34 @@ int main(int argc, char **argv) {
 			if (CurrentKeyboardState[SDL_SCANCODE_X]) ::input_state |= input_b;
 			if (CurrentKeyboardState[SDL_SCANCODE_RETURN]) ::input_state |= input_start;
 			if (CurrentKeyboardState[SDL_SCANCODE_SPACE]) ::input_state |= input_select;
+
+			// one entry per change, numbered by presented frame like --headless steps them
+			if (record && ((frame == 0) || (::input_state != ::input_state_last))) {
+				record << frame << ' ' << std::hex << static_cast<int>(::input_state) << std::dec << '\n';
+			}
 			
+			// catch-up steps only update, the picture is rendered once per present,
+			// turbo runs a fixed number of steps per present whatever the clock says
+			bool turbo = CurrentKeyboardState[SDL_SCANCODE_TAB];
 			int count = 0;
-			bool skip = (lag / unit) > 1;
-			while (lag >= unit) {
+			while (turbo ? (count < turbo_steps) : (lag >= unit)) {
 				if (::input_state & ::input_right) scroll_x += 1;
 				if (::input_state & ::input_left) scroll_x -= 1;
 				if (::input_state & ::input_down) scroll_y += 1;
 				if (::input_state & ::input_up) scroll_y -= 1;
-				runtime.set_scroll(scroll_x, scroll_y);
+				world_stream.update(runtime.ppu(), scroll_x, scroll_y);
 				raster = (raster + 1) % logical_height;
 
+#if 0
+				runtime.clear_raster_log();
+				runtime.record_scroll(0, 0, 0);
+				for (int y = 32; y < logical_height; ++y) {
+					auto base = (y + raster) % logical_height;
+					auto s = std::sin(std::numbers::pi * 2 * (static_cast<double>(base) / static_cast<double>(logical_height - 1)));
+					runtime.record_scroll(y, s * 32, 0);
+				}
+#endif
+
 				for (int i = 0; i < entities.size(); ++i) {
 					auto &spr_x = entities[i].spr_x;
 					auto &spr_y = entities[i].spr_y;
@@ -606,31 +896,21 @@ int main(int argc, char **argv) {
 					);
 				}
 
-				runtime.render_picture(std::span{ fb }, logical_width, logical_height);
-				lag -= unit;
+#if EXPT8_WASM
+				// the last cartridge frame runs after the picture is copied, so only its drawing shows
+				if (turbo && ((count + 1) < turbo_steps)) update_cartridge();
+#endif
 
 				count++;
+				if (turbo) continue;
+
+				lag -= unit;
 				if (count > max_skip) {
 					lag = 0;
 					break;
 				}
-
-				if (skip) {
-					while (SDL_PollEvent(&event) != 0) {
-						if (event.type == SDL_QUIT) {
-							running = false;
-
-						} else if (event.type == SDL_WINDOWEVENT) {
-							if (event.window.windowID != SDL_GetWindowID(window)) {
-								//
-							} else if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
-								running = false;
-							}
-						}
-					}
-					SDL_Delay(1);
-				}
 			}
+			if (turbo) lag = 0;
 
 			SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
 			SDL_RenderClear(renderer);
@@ -643,40 +923,68 @@ int main(int argc, char **argv) {
 			}
 #else
 
-			{
-				auto *format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
+#if EXPT8_PIPELINE
+			// the render thread draws this frame while the next one updates, the texture shows the newest finished one
+			if (count > 0) pipeline.submit(runtime.ppu());
+			bool fetched = pipeline.fetch();
+			if (fetched) ::collisions = &pipeline.collisions();
+			if ((fetched || !screen_ready) && !pipeline.frame().empty()) {
 				void *pixels = nullptr;
 				int pitch = 0;
 				if (SDL_LockTexture(screen, nullptr, &pixels, &pitch) >= 0) {
-					for (int y = 0; y < logical_height; ++y) {
-						auto *dst = (Uint32 *)((Uint8 *)pixels + y * pitch);
-						for (int x = 0; x < logical_width; ++x) {
-							auto index_color = fb[y * logical_width + x];
-							//if (grayscale && ((index_color & 0x0F) <= 0x0C)) index_color = index_color & ~0x0F;
-							dst[x] = palette[index_color];
+					auto frame = pipeline.frame();
+					auto store = [&](const auto &output) {
+						for (int y = 0; y < logical_height; ++y) {
+							output.store(y, 0, frame.subspan(y * logical_width, logical_width));
 						}
+					};
+					auto colors = palettes->get(effect);
+					if (SDL_BYTESPERPIXEL(screen_format) == 2) {
+						store(expt8::rgb16_output{ pixels, static_cast<size_t>(pitch), colors });
+
+					} else {
+						store(expt8::rgb32_output{ pixels, static_cast<size_t>(pitch), colors });
 					}
 					SDL_UnlockTexture(screen);
+					screen_ready = true;
+				}
+			}
+#else
+			// render straight into the texture, only when the picture can have changed
+			if ((count > 0) || !screen_ready) {
+				void *pixels = nullptr;
+				int pitch = 0;
+				if (SDL_LockTexture(screen, nullptr, &pixels, &pitch) >= 0) {
+					auto colors = palettes->get(effect);
+					if (SDL_BYTESPERPIXEL(screen_format) == 2) {
+						runtime.render_picture(expt8::rgb16_output{ pixels, static_cast<size_t>(pitch), colors }, logical_width, logical_height);
+
+					} else {
+						runtime.render_picture(expt8::rgb32_output{ pixels, static_cast<size_t>(pitch), colors }, logical_width, logical_height);
+					}
+					SDL_UnlockTexture(screen);
+					screen_ready = true;
 				}
-				SDL_RenderCopy(renderer, screen, nullptr, nullptr);
 			}
 #endif
+			SDL_RenderCopy(renderer, screen, nullptr, nullptr);
+#endif
 
 #if EXPT8_WASM
-			if (update) {
-				m3_CallV(update);
-				int result = 0;
-				m3_GetResultsV(update, &result);
-			}
+			update_cartridge();
 #endif
 			SDL_RenderPresent(renderer);
+			++frame;
 
 #if 1//EXPT8_WASM
 			std::copy(CurrentKeyboardState, &CurrentKeyboardState[SDL_NUM_SCANCODES], KeyboardState.begin());
 #endif
-			SDL_Delay(1);
+			if (!turbo) SDL_Delay(1);
 		}
 
+		::console = nullptr;
+		::collisions = nullptr;
+
 		SDL_DestroyRenderer(renderer);
 		SDL_DestroyWindow(window);
 		SDL_Quit();
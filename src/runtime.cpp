@@ -1 +1,315 @@
 #include "runtime.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define EXPT8_X86 (1)
+#else
+#define EXPT8_X86 (0)
+#endif
+
+#if EXPT8_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define EXPT8_TARGET(NAME)
+#else
+#define EXPT8_TARGET(NAME) __attribute__((target(NAME)))
+#endif
+#endif
+
+namespace expt8 {
+
+namespace {
+
+constexpr size_t mask_bits = 64;
+
+inline bool test_bit(std::span<const uint64_t> mask, size_t x) {
+	return ((mask[x / mask_bits] >> (x % mask_bits)) & 1) != 0;
+}
+
+// front sprites over the background over back sprites
+inline color_t compose_pixel(const scanline_layers &layers, size_t x) {
+	auto pixel = layers.background[x];
+	if (test_bit(layers.front_opaque, x)) return layers.front_colors[x];
+	if (((pixel & pattern::pixel_mask) == 0) && test_bit(layers.back_opaque, x)) return layers.back_colors[x];
+	return layers.background_colors[pixel % scanline_layers::num_background_colors];
+}
+
+void compose_scalar(const scanline_layers &layers, std::span<color_t> out) {
+	for (size_t x = 0; x < out.size(); ++x) {
+		out[x] = compose_pixel(layers, x);
+	}
+}
+
+template<typename Pixel>
+void expand_scalar(std::span<const color_t> line, color_table colors, Pixel *out) {
+	for (size_t x = 0; x < line.size(); ++x) {
+		out[x] = static_cast<Pixel>(colors[line[x]]);
+	}
+}
+
+size_t find_sprite_rows_scalar(std::span<const int16_t> ys, std::span<const index_t> tile_indices, coordinate_t y, sprite_index_t *out, size_t first = 0) {
+	size_t num = 0;
+	for (size_t i = first; i < ys.size(); ++i) {
+		auto row = y - ys[i];
+		if ((row >= 0) && (row < static_cast<coordinate_t>(pattern::height)) && (tile_indices[i] != 0xFF)) {
+			out[num++] = static_cast<sprite_index_t>(i);
+		}
+	}
+	return num;
+}
+
+#if EXPT8_X86
+
+// 8 sprites per compare, saturation keeps rows far above the line from wrapping into range
+EXPT8_TARGET("sse2")
+size_t find_sprite_rows_sse2(std::span<const int16_t> ys, std::span<const index_t> tile_indices, coordinate_t y, sprite_index_t *out) {
+	constexpr size_t step = 8;
+
+	auto line = _mm_set1_epi16(static_cast<int16_t>(std::clamp<coordinate_t>(y, std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max())));
+	auto below = _mm_set1_epi16(-1);
+	auto height = _mm_set1_epi16(static_cast<int16_t>(pattern::height));
+
+	size_t num = 0;
+	size_t i = 0;
+	for (; i + step <= ys.size(); i += step) {
+		auto row = _mm_subs_epi16(line, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&ys[i])));
+		auto hit = _mm_and_si128(_mm_cmpgt_epi16(row, below), _mm_cmplt_epi16(row, height));
+		auto bits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(hit, _mm_setzero_si128())));
+		while (bits != 0) {
+			auto j = i + std::countr_zero(bits);
+			bits &= bits - 1;
+			if (tile_indices[j] != 0xFF) out[num++] = static_cast<sprite_index_t>(j);
+		}
+	}
+	return num + find_sprite_rows_scalar(ys, tile_indices, y, out + num, i);
+}
+
+inline uint32_t mask_chunk(std::span<const uint64_t> mask, size_t x, size_t size) {
+	return static_cast<uint32_t>((mask[x / mask_bits] >> (x % mask_bits)) & ((uint64_t{ 1 } << size) - 1));
+}
+
+EXPT8_TARGET("sse2")
+inline __m128i expand_mask_sse2(uint32_t bits) {
+	auto lo = static_cast<uint64_t>(bits & 0xFF) * 0x0101010101010101ULL;
+	auto hi = static_cast<uint64_t>((bits >> 8) & 0xFF) * 0x0101010101010101ULL;
+	auto select = _mm_set1_epi64x(0x8040201008040201LL);
+	auto v = _mm_and_si128(_mm_set_epi64x(static_cast<int64_t>(hi), static_cast<int64_t>(lo)), select);
+	return _mm_cmpeq_epi8(v, select);
+}
+
+EXPT8_TARGET("sse2")
+inline __m128i blend_sse2(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+EXPT8_TARGET("sse2")
+void compose_sse2(const scanline_layers &layers, std::span<color_t> out) {
+	constexpr size_t step = 16;
+
+	// no byte shuffle in sse2, so the 16 entry lookup is a compare-select per entry
+	__m128i colors[scanline_layers::num_background_colors];
+	for (size_t i = 0; i < std::size(colors); ++i) {
+		colors[i] = _mm_set1_epi8(static_cast<char>(layers.background_colors[i]));
+	}
+	auto pixel_mask = _mm_set1_epi8(static_cast<char>(pattern::pixel_mask));
+	auto index_mask = _mm_set1_epi8(static_cast<char>(scanline_layers::num_background_colors - 1));
+	auto zero = _mm_setzero_si128();
+
+	size_t x = 0;
+	for (; x + step <= out.size(); x += step) {
+		auto pixel = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&layers.background[x])), index_mask);
+
+		auto background = zero;
+		for (size_t i = 0; i < std::size(colors); ++i) {
+			auto hit = _mm_cmpeq_epi8(pixel, _mm_set1_epi8(static_cast<char>(i)));
+			background = _mm_or_si128(background, _mm_and_si128(hit, colors[i]));
+		}
+
+		auto transparent = _mm_cmpeq_epi8(_mm_and_si128(pixel, pixel_mask), zero);
+		auto front = expand_mask_sse2(mask_chunk(layers.front_opaque, x, step));
+		auto back = _mm_and_si128(expand_mask_sse2(mask_chunk(layers.back_opaque, x, step)), transparent);
+
+		auto front_colors = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&layers.front_colors[x]));
+		auto back_colors = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&layers.back_colors[x]));
+		auto color = blend_sse2(front, front_colors, blend_sse2(back, back_colors, background));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&out[x]), color);
+	}
+	for (; x < out.size(); ++x) {
+		out[x] = compose_pixel(layers, x);
+	}
+}
+
+EXPT8_TARGET("avx2")
+inline __m256i expand_mask_avx2(uint32_t bits) {
+	auto shuffle = _mm256_setr_epi64x(0x0000000000000000LL, 0x0101010101010101LL, 0x0202020202020202LL, 0x0303030303030303LL);
+	auto select = _mm256_set1_epi64x(0x8040201008040201LL);
+	auto v = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(bits)), shuffle);
+	return _mm256_cmpeq_epi8(_mm256_and_si256(v, select), select);
+}
+
+EXPT8_TARGET("avx2")
+void compose_avx2(const scanline_layers &layers, std::span<color_t> out) {
+	constexpr size_t step = 32;
+
+	auto table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(layers.background_colors.data())));
+	auto pixel_mask = _mm256_set1_epi8(static_cast<char>(pattern::pixel_mask));
+	auto index_mask = _mm256_set1_epi8(static_cast<char>(scanline_layers::num_background_colors - 1));
+	auto zero = _mm256_setzero_si256();
+
+	size_t x = 0;
+	for (; x + step <= out.size(); x += step) {
+		auto pixel = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(&layers.background[x])), index_mask);
+		auto background = _mm256_shuffle_epi8(table, pixel);
+
+		auto transparent = _mm256_cmpeq_epi8(_mm256_and_si256(pixel, pixel_mask), zero);
+		auto front = expand_mask_avx2(mask_chunk(layers.front_opaque, x, step));
+		auto back = _mm256_and_si256(expand_mask_avx2(mask_chunk(layers.back_opaque, x, step)), transparent);
+
+		auto front_colors = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&layers.front_colors[x]));
+		auto back_colors = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&layers.back_colors[x]));
+		auto color = _mm256_blendv_epi8(_mm256_blendv_epi8(background, back_colors, back), front_colors, front);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[x]), color);
+	}
+	for (; x < out.size(); ++x) {
+		out[x] = compose_pixel(layers, x);
+	}
+}
+
+// sse2 has no gather, so only avx2 gets a vector expansion
+EXPT8_TARGET("avx2")
+inline __m256i gather_avx2(const color_t *line, const uint32_t *colors) {
+	auto indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(line)));
+	return _mm256_i32gather_epi32(reinterpret_cast<const int *>(colors), indices, 4);
+}
+
+EXPT8_TARGET("avx2")
+void expand_rgb32_avx2(std::span<const color_t> line, color_table colors, uint32_t *out) {
+	constexpr size_t step = 16;
+
+	size_t x = 0;
+	for (; x + step <= line.size(); x += step) {
+		auto lo = gather_avx2(&line[x], colors.data());
+		auto hi = gather_avx2(&line[x + 8], colors.data());
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[x]), lo);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[x + 8]), hi);
+	}
+	for (; x < line.size(); ++x) {
+		out[x] = colors[line[x]];
+	}
+}
+
+EXPT8_TARGET("avx2")
+void expand_rgb16_avx2(std::span<const color_t> line, color_table colors, uint16_t *out) {
+	constexpr size_t step = 16;
+
+	// the tables hold 16 bit pixels, so packing never saturates
+	size_t x = 0;
+	for (; x + step <= line.size(); x += step) {
+		auto lo = gather_avx2(&line[x], colors.data());
+		auto hi = gather_avx2(&line[x + 8], colors.data());
+		auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[x]), packed);
+	}
+	for (; x < line.size(); ++x) {
+		out[x] = static_cast<uint16_t>(colors[line[x]]);
+	}
+}
+
+bool has_sse2() {
+#if defined(_MSC_VER)
+	int info[4] = {};
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool has_avx2() {
+#if defined(_MSC_VER)
+	int info[4] = {};
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || ((_xgetbv(0) & 0x6) != 0x6)) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+} // namespace
+
+bool is_render_path_supported(render_path path) {
+	switch (path) {
+	case render_path::automatic:
+	case render_path::scalar:
+		return true;
+#if EXPT8_X86
+	case render_path::sse2: {
+		static const bool supported = has_sse2();
+		return supported;
+	}
+	case render_path::avx2: {
+		static const bool supported = has_avx2();
+		return supported;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+render_path detect_render_path() {
+	static const auto path = [] {
+		if (is_render_path_supported(render_path::avx2)) return render_path::avx2;
+		if (is_render_path_supported(render_path::sse2)) return render_path::sse2;
+		return render_path::scalar;
+	}();
+	return path;
+}
+
+compose_kernel get_compose_kernel(render_path path) {
+	if (path == render_path::automatic) path = detect_render_path();
+	switch (path) {
+#if EXPT8_X86
+	case render_path::sse2:
+		return compose_sse2;
+	case render_path::avx2:
+		return compose_avx2;
+#endif
+	default:
+		return compose_scalar;
+	}
+}
+
+expand_kernel<uint32_t> get_rgb32_kernel(render_path path) {
+	if (path == render_path::automatic) path = detect_render_path();
+#if EXPT8_X86
+	if ((path == render_path::avx2) && is_render_path_supported(path)) return expand_rgb32_avx2;
+#endif
+	return expand_scalar<uint32_t>;
+}
+
+expand_kernel<uint16_t> get_rgb16_kernel(render_path path) {
+	if (path == render_path::automatic) path = detect_render_path();
+#if EXPT8_X86
+	if ((path == render_path::avx2) && is_render_path_supported(path)) return expand_rgb16_avx2;
+#endif
+	return expand_scalar<uint16_t>;
+}
+
+size_t find_sprite_rows(std::span<const int16_t> ys, std::span<const index_t> tile_indices, coordinate_t y, sprite_index_t *out, render_path path) {
+	if (path == render_path::automatic) path = detect_render_path();
+#if EXPT8_X86
+	if ((path != render_path::scalar) && is_render_path_supported(render_path::sse2)) return find_sprite_rows_sse2(ys, tile_indices, y, out);
+#endif
+	return find_sprite_rows_scalar(ys, tile_indices, y, out);
+}
+
+} // namespace expt8
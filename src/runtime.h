@@ -1,11 +1,22 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdlib>
 #include <array>
+#include <bit>
 #include <vector>
 #include <span>
 #include <algorithm>
 #include <tuple>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <concepts>
+#include <type_traits>
 
 namespace expt8 {
 
@@ -22,6 +33,27 @@ using pixel_t = palette_color_index_t;
 enum class mirror_mode {
 	vertical,
 	horizontal,
+	four_screen,
+};
+
+enum class render_path {
+	automatic,
+	scalar,
+	sse2,
+	avx2,
+};
+
+// reference draws every pixel on its own and is what the optimized backend is checked against
+enum class render_backend {
+	optimized,
+	reference,
+};
+
+struct rect {
+	coordinate_t x = 0;
+	coordinate_t y = 0;
+	coordinate_t width = 0;
+	coordinate_t height = 0;
 };
 
 struct palette {
@@ -39,61 +71,119 @@ struct pattern {
 	static constexpr size_t width = 8;
 	static constexpr size_t height = 8;
 	static constexpr size_t num_pixels = width * height;
-
-	std::array<pixel_t, num_pixels> pixels;
+	static constexpr size_t bits_per_pixel = 2;
+	static constexpr size_t num_planes = bits_per_pixel;
+	static constexpr pixel_t pixel_mask = (1 << bits_per_pixel) - 1;
+
+	using row_t = std::array<pixel_t, width>;
+	using packed_row_t = uint64_t;
+
+	// two bitplanes per row, the leftmost pixel in the most significant bit
+	std::array<std::array<uint8_t, num_planes>, height> planes;
+
+	static constexpr auto decode_table = [] {
+		std::array<packed_row_t, 256> table{};
+		for (size_t bits = 0; bits < table.size(); ++bits) {
+			for (size_t x = 0; x < width; ++x) {
+				auto byte = (std::endian::native == std::endian::little) ? x : (width - 1 - x);
+				table[bits] |= static_cast<packed_row_t>((bits >> (width - 1 - x)) & 1) << (byte * 8);
+			}
+		}
+		return table;
+	}();
+
+	// mirrors the plane bits of a row, so a flipped row decodes like any other
+	static constexpr auto reverse_table = [] {
+		std::array<uint8_t, 256> table{};
+		for (size_t bits = 0; bits < table.size(); ++bits) {
+			for (size_t x = 0; x < width; ++x) {
+				table[bits] |= static_cast<uint8_t>(((bits >> x) & 1) << (width - 1 - x));
+			}
+		}
+		return table;
+	}();
 
 	pixel_t pixel(size_t position) const {
-		return pixels[position % num_pixels];
+		return pixel(position % width, position / width);
 	}
 
 	pixel_t pixel(size_t x, size_t y) const {
-		return pixel((y % height) * width + (x % width));
+		auto &row = planes[y % height];
+		auto shift = (width - 1) - (x % width);
+		return static_cast<pixel_t>(((row[0] >> shift) & 1) | (((row[1] >> shift) & 1) << 1));
+	}
+
+	void pixel(size_t position, pixel_t value) {
+		auto &row = planes[(position / width) % height];
+		auto mask = static_cast<uint8_t>(1 << ((width - 1) - (position % width)));
+		for (size_t plane = 0; plane < num_planes; ++plane) {
+			if (value & (1 << plane)) {
+				row[plane] |= mask;
+			} else {
+				row[plane] &= ~mask;
+			}
+		}
+	}
+
+	packed_row_t packed_row(size_t y, bool flip = false) const {
+		auto &row = planes[y % height];
+		if (flip) return decode_table[reverse_table[row[0]]] | (decode_table[reverse_table[row[1]]] << 1);
+		return decode_table[row[0]] | (decode_table[row[1]] << 1);
+	}
+
+	row_t row(size_t y, bool flip = false) const {
+		return std::bit_cast<row_t>(packed_row(y, flip));
+	}
+
+	uint8_t opaque_bits(size_t y, bool flip = false) const {
+		auto &row = planes[y % height];
+		auto bits = static_cast<uint8_t>(row[0] | row[1]);
+		return flip ? reverse_table[bits] : bits;
 	}
 
 	void write(std::span<pixel_t> src) {
-		std::copy(src.begin(), src.end(), pixels.begin());
+		auto size = std::min(src.size(), num_pixels);
+		for (size_t i = 0; i < size; ++i) {
+			pixel(i, src[i]);
+		}
 	}
 };
 
+using bank_index_t = uint16_t;
+
+// 256 patterns seen through 1 KB bank windows onto a pool of patterns
 struct pattern_table {
 	static constexpr size_t num_patterns = 256;
+	static constexpr size_t bank_size = 64;
+	static constexpr size_t num_windows = num_patterns / bank_size;
 
-	std::array<pattern, num_patterns> patterns;
+	std::span<const pattern> pool;
+	const bank_index_t *banks = nullptr;
 
 	auto &get_pattern(size_t position) const {
-		return patterns[position % num_patterns];
-	}
-
-	auto &get_pattern(size_t position) {
-		return patterns[position % num_patterns];
+		position %= num_patterns;
+		auto bank = std::min<size_t>(banks[position / bank_size], pool.size() / bank_size - 1);
+		return pool[bank * bank_size + position % bank_size];
 	}
 
 	pixel_t get_pixel(size_t position, size_t x, size_t y) const {
 		return get_pattern(position).pixel(x, y);
 	}
+};
 
-	void write(size_t position, std::span<pixel_t> src) {
-		if (src.size() > pattern::num_pixels) {
-			auto num = src.size() / pattern::num_pixels;
-			auto last = (num - 1);
-			auto fraction = src.size() % pattern::num_pixels;
-			for (size_t i = 0; i < num; ++i) {
-				auto offset = i * pattern::num_pixels;
-				auto size = pattern::num_pixels;
-				if (i == last && fraction > 0) {
-					size = fraction;
-				}
-				get_pattern(position + i).write(std::span{ &src[offset], size});
-			}
+// the pool bank each window of both pattern tables shows, the first banks in order by default
+struct pattern_banks {
+	static constexpr size_t num_tables = 2;
+	static constexpr size_t num_windows = num_tables * pattern_table::num_windows;
+	static constexpr size_t max_num_banks = std::numeric_limits<bank_index_t>::max() + 1;
 
-		} else {
-			get_pattern(position).write(src);
-		}
-	}
+	std::array<bank_index_t, num_windows> windows = [] {
+		std::array<bank_index_t, num_windows> windows{};
+		for (size_t i = 0; i < windows.size(); ++i) windows[i] = static_cast<bank_index_t>(i);
+		return windows;
+	}();
 
-	void write(std::span<pixel_t> &&src) {
-		write(0, std::move(src));
-	}
+	bool operator==(const pattern_banks &other) const = default;
 };
 
 struct block {
@@ -152,8 +242,8 @@ struct tile_table {
 };
 
 struct name_table {
-	tile_table tile_table;
-	block_table block_table;
+	expt8::tile_table tile_table;
+	expt8::block_table block_table;
 
 	std::tuple<index_t, index_t> get(size_t x, size_t y) const {
 		auto tile_x = x / pattern::width;
@@ -180,12 +270,13 @@ struct name_table {
 	}
 };
 
-struct background_plane {
-	static constexpr auto name_table_mirroring = mirror_mode::vertical;
+template<mirror_mode Mirroring>
+struct basic_background_plane {
+	static constexpr auto name_table_mirroring = Mirroring;
 
-	static constexpr size_t num_name_tables = 2;
-	static constexpr size_t width = (name_table_mirroring == mirror_mode::vertical) ? num_name_tables : 1;
-	static constexpr size_t height = (name_table_mirroring == mirror_mode::horizontal) ? num_name_tables : 1;
+	static constexpr size_t num_name_tables = (name_table_mirroring == mirror_mode::four_screen) ? 4 : 2;
+	static constexpr size_t width = (name_table_mirroring == mirror_mode::horizontal) ? 1 : 2;
+	static constexpr size_t height = (name_table_mirroring == mirror_mode::vertical) ? 1 : 2;
 
 	static constexpr size_t num_palettes = 4;
 	static constexpr size_t pixel_width = tile_table::width * pattern::width;
@@ -243,15 +334,18 @@ struct background_plane {
 		}
 	}
 
-	std::tuple<index_t, const palette *> get(size_t x, size_t y) const {
+	std::tuple<index_t, index_t> get_index(size_t x, size_t y) const {
 		auto name_table_x = x / pixel_width;
 		auto name_table_y = y / pixel_height;
 		auto &name_table = get_name_table(name_table_x, name_table_y);
 
 		auto name_x = x % pixel_width;
 		auto name_y = y % pixel_height;
-		auto [tile_index, palette_index] = name_table.get(name_x, name_y);
+		return name_table.get(name_x, name_y);
+	}
 
+	std::tuple<index_t, const palette *> get(size_t x, size_t y) const {
+		auto [tile_index, palette_index] = get_index(x, y);
 		return { tile_index, &get_palette(palette_index) };
 	}
 
@@ -264,6 +358,204 @@ struct background_plane {
 	}
 };
 
+using background_plane = basic_background_plane<mirror_mode::vertical>;
+
+// a background drawn over or under the main one with its own name tables and scroll,
+// the palettes of the main background are shared
+template<typename Plane>
+struct basic_background_layer {
+	Plane plane;
+	coordinate_t scroll_x = 0;
+	coordinate_t scroll_y = 0;
+	int priority = 0;
+	bool enabled = false;
+	bool transparent = true;
+};
+
+using background_layer = basic_background_layer<background_plane>;
+
+// a background larger than the name tables, in tiles, or in metatiles when a metatile set is given
+class world_map {
+public:
+	using metatile_index_t = uint16_t;
+
+	// one block of tiles sharing a palette
+	struct metatile {
+		std::array<index_t, block::width * block::height> tile_indices{};
+		index_t palette_index = 0;
+	};
+
+	world_map() = default;
+
+	// in tiles, rounded up to whole blocks
+	world_map(size_t width, size_t height, std::span<const metatile> metatiles = {})
+		: _block_width((width + block::width - 1) / block::width)
+		, _block_height((height + block::height - 1) / block::height)
+		, _metatiles(metatiles.begin(), metatiles.end()) {
+		if (_metatiles.empty()) {
+			_tile_indices.resize(_block_width * block::width * _block_height * block::height);
+			_palette_indices.resize(_block_width * _block_height);
+		} else {
+			_metatile_indices.resize(_block_width * _block_height);
+		}
+	}
+
+	auto width() const { return _block_width * block::width; }
+	auto height() const { return _block_height * block::height; }
+	bool has_metatiles() const { return !_metatiles.empty(); }
+
+	// tiles and palettes of a map without metatiles
+	void set_tile(size_t x, size_t y, index_t index) {
+		if (!has_metatiles()) _tile_indices[(y % height()) * width() + (x % width())] = index;
+	}
+
+	void set_tile_palette(size_t x, size_t y, index_t index) {
+		if (!has_metatiles()) _palette_indices[block_position(x / block::width, y / block::height)] = index;
+	}
+
+	// in blocks, for a map with metatiles
+	void set_metatile(size_t block_x, size_t block_y, metatile_index_t index) {
+		if (has_metatiles()) _metatile_indices[block_position(block_x, block_y)] = index;
+	}
+
+	void set_metatile(metatile_index_t index, const metatile &it) {
+		if (index < _metatiles.size()) _metatiles[index] = it;
+	}
+
+	// tile and palette index at a tile position, wrapping around the map
+	std::tuple<index_t, index_t> get(coordinate_t x, coordinate_t y) const {
+		auto xx = wrap(x, width());
+		auto yy = wrap(y, height());
+		if (!has_metatiles()) {
+			return { _tile_indices[yy * width() + xx], _palette_indices[block_position(xx / block::width, yy / block::height)] };
+		}
+		auto &it = _metatiles[_metatile_indices[block_position(xx / block::width, yy / block::height)] % _metatiles.size()];
+		return { it.tile_indices[(yy % block::height) * block::width + (xx % block::width)], it.palette_index };
+	}
+
+private:
+	static size_t wrap(coordinate_t value, size_t size) {
+		auto wrapped = value % static_cast<coordinate_t>(size);
+		return static_cast<size_t>((wrapped < 0) ? (wrapped + static_cast<coordinate_t>(size)) : wrapped);
+	}
+
+	size_t block_position(size_t block_x, size_t block_y) const {
+		return (block_y % _block_height) * _block_width + (block_x % _block_width);
+	}
+
+	size_t _block_width = 0;
+	size_t _block_height = 0;
+
+	std::vector<index_t> _tile_indices;
+	std::vector<index_t> _palette_indices;
+
+	std::vector<metatile> _metatiles;
+	std::vector<metatile_index_t> _metatile_indices;
+};
+
+// the whole background decoded with one pattern table, in the same pixel format as a background scanline
+template<typename Plane>
+struct basic_background_cache {
+	static constexpr size_t width = Plane::full_pixel_width;
+	static constexpr size_t height = Plane::full_pixel_height;
+	static constexpr size_t tile_width = width / pattern::width;
+	static constexpr size_t tile_height = height / pattern::height;
+	static constexpr size_t num_tiles = tile_width * tile_height;
+
+	std::vector<pixel_t> pixels;
+	std::vector<uint8_t> valid_tiles;
+	size_t num_invalid_tiles = 0;
+
+	void invalidate() {
+		valid_tiles.assign(num_tiles, 0);
+		num_invalid_tiles = num_tiles;
+	}
+
+	void invalidate_tile(size_t tile_x, size_t tile_y) {
+		if (valid_tiles.empty()) return;
+		auto &valid = valid_tiles[(tile_y % tile_height) * tile_width + (tile_x % tile_width)];
+		if (valid) {
+			valid = 0;
+			++num_invalid_tiles;
+		}
+	}
+
+	void invalidate_tile(size_t name_table_index, size_t x, size_t y) {
+		auto position = name_table_index % Plane::num_name_tables;
+		auto name_table_x = position % Plane::width;
+		auto name_table_y = position / Plane::width;
+		invalidate_tile(name_table_x * tile_table::width + (x % tile_table::width), name_table_y * tile_table::height + (y % tile_table::height));
+	}
+
+	void invalidate_block(size_t name_table_index, size_t x, size_t y) {
+		auto left = x - (x % block::width);
+		auto top = y - (y % block::height);
+		for (size_t yy = top; yy < top + block::height; ++yy) {
+			for (size_t xx = left; xx < left + block::width; ++xx) {
+				invalidate_tile(name_table_index, xx, yy);
+			}
+		}
+	}
+
+	// tiles whose index lies in [first, first + num) on the pattern table this cache decodes
+	void invalidate_patterns(const Plane &plane, size_t first, size_t num) {
+		if (valid_tiles.empty()) return;
+		if (num >= pattern_table::num_patterns) {
+			invalidate();
+			return;
+		}
+		for (size_t tile_y = 0; tile_y < tile_height; ++tile_y) {
+			for (size_t tile_x = 0; tile_x < tile_width; ++tile_x) {
+				auto [tile_index, palette_index] = plane.get_index(tile_x * pattern::width, tile_y * pattern::height);
+				if (((tile_index + pattern_table::num_patterns - (first % pattern_table::num_patterns)) % pattern_table::num_patterns) < num) {
+					invalidate_tile(tile_x, tile_y);
+				}
+			}
+		}
+	}
+
+	void validate(const Plane &plane, pattern_table table) {
+		if (valid_tiles.empty()) {
+			pixels.resize(width * height);
+			invalidate();
+		}
+		if (num_invalid_tiles == 0) return;
+
+		for (size_t tile_y = 0; tile_y < tile_height; ++tile_y) {
+			for (size_t tile_x = 0; tile_x < tile_width; ++tile_x) {
+				auto &valid = valid_tiles[tile_y * tile_width + tile_x];
+				if (valid) continue;
+
+				auto x = tile_x * pattern::width;
+				auto y = tile_y * pattern::height;
+				auto [tile_index, palette_index] = plane.get_index(x, y);
+				auto palette_bits = static_cast<pattern::packed_row_t>(palette_index % Plane::num_palettes) << pattern::bits_per_pixel;
+				auto &pattern = table.get_pattern(tile_index);
+				for (size_t row_y = 0; row_y < pattern::height; ++row_y) {
+					auto row = std::bit_cast<pattern::row_t>(pattern.packed_row(row_y) | (palette_bits * 0x0101010101010101ULL));
+					std::copy(row.begin(), row.end(), &pixels[(y + row_y) * width + x]);
+				}
+				valid = 1;
+			}
+		}
+		num_invalid_tiles = 0;
+	}
+
+	// wrap-aware copy of one background row starting at (x, y)
+	void copy_row(size_t x, size_t y, std::span<pixel_t> line) const {
+		auto *row = &pixels[(y % height) * width];
+		x %= width;
+		for (size_t i = 0; i < line.size();) {
+			auto size = std::min(width - x, line.size() - i);
+			std::copy_n(&row[x], size, &line[i]);
+			i += size;
+			x = 0;
+		}
+	}
+};
+
+using background_cache = basic_background_cache<background_plane>;
+
 struct sprite {
 	enum attribute {
 		_priority_back,
@@ -282,29 +574,120 @@ struct sprite {
 	attribute_t attributes = 0;
 
 	auto left() const { return x; }
-	auto right() const { return left() + pattern::width; }
+	auto right() const { return left() + static_cast<coordinate_t>(pattern::width); }
 	auto top() const { return y; }
-	auto bottom() const { return top() + pattern::height; }
+	auto bottom() const { return top() + static_cast<coordinate_t>(pattern::height); }
 	bool has_attribute(uint32_t attr) const { return (attributes & attr) != 0; }
+
+	// pattern coordinates of a screen position inside the sprite, flips applied
+	coordinate_t column(coordinate_t screen_x) const {
+		auto column = screen_x - x;
+		return has_attribute(flip_horizontally) ? static_cast<coordinate_t>(pattern::width - 1) - column : column;
+	}
+
+	coordinate_t row(coordinate_t screen_y) const {
+		auto row = screen_y - y;
+		return has_attribute(flip_vertically) ? static_cast<coordinate_t>(pattern::height - 1) - row : row;
+	}
 };
 
+using sprite_index_t = uint16_t;
+
+// rows of the sprites overlapping scanline y, hidden sprites skipped, returns the number written
+size_t find_sprite_rows(std::span<const int16_t> ys, std::span<const index_t> tile_indices, coordinate_t y, sprite_index_t *out, render_path path = render_path::automatic);
+
+// the classic 64 entry OAM by default, resizable to thousands of sprites
 struct sprite_plane {
 	static constexpr size_t num_sprites = 64;
+	static constexpr size_t max_num_sprites = std::numeric_limits<sprite_index_t>::max() + 1;
 	static constexpr size_t num_palettes = 4;
 	static constexpr size_t max_sprites_on_scanline = 8;
 
-	std::array<sprite, num_sprites> sprites;
+	// the sprites binned to one scanline, in OAM order
+	struct scanline {
+		std::vector<sprite_index_t> front_sprites;
+		std::vector<sprite_index_t> back_sprites;
+
+		auto front() const { return std::span{ front_sprites }; }
+		auto back() const { return std::span{ back_sprites }; }
+		size_t size() const { return front_sprites.size() + back_sprites.size(); }
+		void clear() { front_sprites.clear(); back_sprites.clear(); }
+
+		bool operator==(const scanline &other) const = default;
+
+		void push(attribute_t attributes, size_t position) {
+			auto &sprites = ((attributes & sprite::priority_back) != 0) ? back_sprites : front_sprites;
+			sprites.push_back(static_cast<sprite_index_t>(position));
+		}
+	};
+
+	struct line_buffer {
+		using mask_t = uint64_t;
+		static constexpr size_t mask_bits = std::numeric_limits<mask_t>::digits;
+
+		std::vector<color_t> colors;
+		std::vector<mask_t> opaque;
+
+		void resize(size_t width) {
+			colors.resize(width);
+			opaque.resize((width + mask_bits - 1) / mask_bits);
+		}
+
+		void clear() { std::fill(opaque.begin(), opaque.end(), 0); }
+
+		// earlier blits win, so only pixels not yet covered are written
+		void blit(coordinate_t x, const pattern::row_t &row, uint8_t opaque_bits, const palette &palette) {
+			while (opaque_bits != 0) {
+				auto i = std::countl_zero(opaque_bits);
+				opaque_bits &= ~static_cast<uint8_t>(0x80 >> i);
+
+				auto position = x + i;
+				if ((position < 0) || (position >= static_cast<coordinate_t>(colors.size()))) continue;
+
+				auto &word = opaque[position / mask_bits];
+				auto bit = mask_t{ 1 } << (position % mask_bits);
+				if ((word & bit) == 0) {
+					word |= bit;
+					colors[position] = palette.color(row[i]);
+				}
+			}
+		}
+	};
+
+	// structure of arrays, so scans only touch the fields they test
+	std::vector<int16_t> xs = std::vector<int16_t>(num_sprites, 0);
+	std::vector<int16_t> ys = std::vector<int16_t>(num_sprites, 0);
+	std::vector<index_t> tile_indices = std::vector<index_t>(num_sprites, 0xFF);
+	std::vector<index_t> palette_indices = std::vector<index_t>(num_sprites, 0);
+	std::vector<attribute_t> attributes = std::vector<attribute_t>(num_sprites, 0);
 	std::array<palette, num_palettes> palettes;
 	index_t pattern_table_index = 0;
 
-	auto &get_sprite(size_t position) const {
-		return sprites[position % sprites.size()];
+	// 0 lifts the per scanline limit
+	size_t scanline_limit = max_sprites_on_scanline;
+
+	auto size() const { return tile_indices.size(); }
+
+	// new sprites start hidden
+	void resize(size_t new_num_sprites) {
+		auto num = std::clamp<size_t>(new_num_sprites, 1, max_num_sprites);
+		xs.resize(num, 0);
+		ys.resize(num, 0);
+		tile_indices.resize(num, 0xFF);
+		palette_indices.resize(num, 0);
+		attributes.resize(num, 0);
 	}
 
-	auto &get_sprite(size_t position) {
-		return sprites[position % sprites.size()];
+	bool accepts(const scanline &line) const {
+		return (scanline_limit == 0) || (line.size() < scanline_limit);
 	}
 
+	sprite get_sprite(size_t position) const {
+		auto i = position % size();
+		return { xs[i], ys[i], tile_indices[i], palette_indices[i], attributes[i] };
+	}
+
+	// coordinates are packed to 16 bits, clamping keeps far away sprites off screen
 	void set_sprite(
 		size_t position,
 		coordinate_t x = 0,
@@ -313,12 +696,11 @@ struct sprite_plane {
 		index_t palette_index = 0,
 		attribute_t attributes = 0
 	) {
-		auto &target = get_sprite(position);
-		target.x = x;
-		target.y = y;
-		target.tile_index = tile_index;
-		target.palette_index = palette_index;
-		target.attributes = attributes;
+		auto i = position % size();
+		set_sprite_position(i, x, y);
+		tile_indices[i] = tile_index;
+		palette_indices[i] = palette_index;
+		this->attributes[i] = attributes;
 	}
 
 	void set_sprite_position(
@@ -326,9 +708,11 @@ struct sprite_plane {
 		coordinate_t x = 0,
 		coordinate_t y = 0
 	) {
-		auto &target = get_sprite(position);
-		target.x = x;
-		target.y = y;
+		constexpr coordinate_t min = std::numeric_limits<int16_t>::min();
+		constexpr coordinate_t max = std::numeric_limits<int16_t>::max() - static_cast<coordinate_t>(pattern::height);
+		auto i = position % size();
+		xs[i] = static_cast<int16_t>(std::clamp(x, min, max));
+		ys[i] = static_cast<int16_t>(std::clamp(y, min, max));
 	}
 
 	auto &get_palette(size_t position) const {
@@ -359,276 +743,1950 @@ struct sprite_plane {
 			get_palette(palette_index_offset + i).color(std::span{ &src[i * palette::num_colors], size });
 		}
 	}
-	
-	bool find_sprites(coordinate_t x, coordinate_t y, std::vector<const sprite *> &out_front_sprites, std::vector<const sprite *> &out_back_sprites) const {
-		bool found = false;
-		for (auto &it : sprites) {
-			if (it.tile_index == 0xFF) {
-				// unused
-			} else if (x < it.left()) {
-				// no hit
-			} else if (y < it.top()) {
-				// no hit
-			} else if (x >= it.right()) {
-				// no hit
-			} else if (y >= it.bottom()) {
-				// no hit
-			} else {
-				if (it.has_attribute(sprite::priority_back)) {
-					out_back_sprites.push_back(&it);
-				} else {
-					out_front_sprites.push_back(&it);
-				}
-				found = true;
-				if ((out_back_sprites.size() + out_front_sprites.size()) >= max_sprites_on_scanline) break;
-			}
-		}
-		return found;
+
+	// the sprites drawn on scanline y, limited per scanline in OAM order like bin_sprites
+	size_t find_sprites(coordinate_t y, std::vector<sprite_index_t> &out_sprites, render_path path = render_path::automatic) const {
+		out_sprites.resize(size());
+		auto num = find_sprite_rows(ys, tile_indices, y, out_sprites.data(), path);
+		return (scanline_limit == 0) ? num : std::min(num, scanline_limit);
 	}
 
-	bool find_sprites(coordinate_t y, std::vector<const sprite *> &out_front_sprites, std::vector<const sprite *> &out_back_sprites) const {
-		bool found = false;
-		for (auto &it : sprites) {
-			if (it.tile_index == 0xFF) {
-				// unused
-			} else if (y < it.top()) {
-				// no hit
-			} else if (y >= it.bottom()) {
-				// no hit
-			} else {
-				if (it.has_attribute(sprite::priority_back)) {
-					out_back_sprites.push_back(&it);
-				} else {
-					out_front_sprites.push_back(&it);
-				}
-				found = true;
-				if ((out_back_sprites.size() + out_front_sprites.size()) >= max_sprites_on_scanline) break;
+	// bins are the y index, every sprite lands on the scanlines it covers
+	void bin_sprites(std::span<scanline> scanlines, coordinate_t first_line = 0) const {
+		auto last_line = static_cast<coordinate_t>(scanlines.size());
+		for (auto y = first_line; y < last_line; ++y) {
+			scanlines[y].clear();
+		}
+		for (size_t i = 0; i < size(); ++i) {
+			if (tile_indices[i] == 0xFF) continue;
+
+			auto top = std::max<coordinate_t>(ys[i], first_line);
+			auto bottom = std::min<coordinate_t>(ys[i] + static_cast<coordinate_t>(pattern::height), last_line);
+			for (auto y = top; y < bottom; ++y) {
+				if (auto &line = scanlines[y]; accepts(line)) line.push(attributes[i], i);
 			}
 		}
-		return found;
 	}
 };
 
-class picture_processing_unit {
-public:
-	static constexpr size_t num_pattern_tables = 2;
+// opaque sprite pixels found over opaque background pixels or other sprites during a render
+struct collision_report {
+	enum flag : uint8_t {
+		background = 1 << 0,
+		sprite = 1 << 1,
+	};
 
-	using callback = std::function<void(int, int)>;
+	using pair = std::pair<sprite_index_t, sprite_index_t>;
 
-	enum attribute {
-		_vblank,
-		_hblank,
-		_always,
+	// the first hit of sprite 0 in scan order
+	bool sprite_zero_hit = false;
+	coordinate_t sprite_zero_x = 0;
+	coordinate_t sprite_zero_y = 0;
 
-		vblank = 1 << _vblank,
-		hblank = 1 << _hblank,
-		always = 1 << _always,
-	};
+	std::vector<uint8_t> flags;
 
-public:
-	auto &get_pattern_table(size_t position) const {
-		return _pattern_tables[position % num_pattern_tables];
-	}
+	// lower index first, sorted and unique once the render is done
+	std::vector<pair> pairs;
 
-	auto &get_pattern_table(size_t position) {
-		return _pattern_tables[position % num_pattern_tables];
+	void clear(size_t num_sprites) {
+		sprite_zero_hit = false;
+		flags.assign(num_sprites, 0);
+		pairs.clear();
 	}
 
-	bool render(std::span<color_t> framebuffer, size_t width, size_t height) {
-		std::vector<const sprite *> front_sprites;
-		std::vector<const sprite *> back_sprites;
-
-		for (int y = 0; y < height; ++y) {
-			if (!update_timing(always)) {
-				bool update = update_timing(hblank);
-				if (y == 0) {
-					update = update || update_timing(vblank);
-				}
-				if (update) invoke_callback(0, y);
+	void hit_zero(coordinate_t x, coordinate_t y) {
+		if (sprite_zero_hit && ((sprite_zero_y < y) || ((sprite_zero_y == y) && (sprite_zero_x <= x)))) return;
+		sprite_zero_hit = true;
+		sprite_zero_x = x;
+		sprite_zero_y = y;
+	}
 
-				front_sprites.clear();
-				back_sprites.clear();
-				_sprite_plane.find_sprites(y, front_sprites, back_sprites);
-			}
+	void hit_pair(sprite_index_t a, sprite_index_t b) {
+		flags[a] |= sprite;
+		flags[b] |= sprite;
+		auto it = std::minmax(a, b);
+		if (pairs.empty() || (pairs.back() != pair{ it.first, it.second })) pairs.emplace_back(it.first, it.second);
+	}
 
-			for (int x = 0; x < width; ++x) {
-				if (update_timing(always)) {
-					invoke_callback(x, y);
+	void merge(const collision_report &other) {
+		if (other.sprite_zero_hit) hit_zero(other.sprite_zero_x, other.sprite_zero_y);
+		for (size_t i = 0; i < std::min(flags.size(), other.flags.size()); ++i) {
+			flags[i] |= other.flags[i];
+		}
+		pairs.insert(pairs.end(), other.pairs.begin(), other.pairs.end());
+	}
 
-					front_sprites.clear();
-					back_sprites.clear();
-					_sprite_plane.find_sprites(x, y, front_sprites, back_sprites);
-				}
-				auto xx = x + (scroll_x % static_cast<int>(background_plane::full_pixel_width));
-				auto yy = y + (scroll_y % static_cast<int>(background_plane::full_pixel_height));
-				if (xx < 0) xx += static_cast<int>(background_plane::full_pixel_width);
-				if (yy < 0) yy += static_cast<int>(background_plane::full_pixel_height);
+	void finish() {
+		std::sort(pairs.begin(), pairs.end());
+		pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+	}
+};
 
-				auto color = _background_color;
-				bool found_color = false;
-
-				if (front_sprites.size() > 0) {
-					for (auto *sprite : front_sprites) {
-						if ((x < sprite->left()) || (x >= sprite->right())) continue;
-						auto palette = _sprite_plane.get_palette(sprite->palette_index);
-						auto pixel = get_pattern_table(_sprite_plane.pattern_table_index).get_pixel(sprite->tile_index, x - sprite->x, y - sprite->y);
-						if (pixel > 0) {
-							color = palette.color(pixel);
-							found_color = true;
-							break;
-						}
-					}
-				}
+struct scanline_layers {
+	static constexpr size_t num_background_colors = 4 * palette::num_colors;
 
-				if (!found_color) {
-					auto [tile_index, palette] = _background_plane.get(xx, yy);
-					auto pixel = get_pattern_table(_background_plane.pattern_table_index).get_pixel(tile_index, xx, yy);
-					if (pixel > 0) {
-						color = palette->color(pixel);
-						found_color = true;
-					}
-				}
+	std::span<const pixel_t> background;
+	std::span<const uint64_t> front_opaque;
+	std::span<const color_t> front_colors;
+	std::span<const uint64_t> back_opaque;
+	std::span<const color_t> back_colors;
 
-				if (!found_color && (back_sprites.size() > 0)) {
-					for (auto *sprite : back_sprites) {
-						if ((x < sprite->left()) || (x >= sprite->right())) continue;
-						auto palette = _sprite_plane.get_palette(sprite->palette_index);
-						auto pixel = get_pattern_table(_sprite_plane.pattern_table_index).get_pixel(sprite->tile_index, x - sprite->x, y - sprite->y);
-						if (pixel > 0) {
-							color = palette.color(pixel);
-							found_color = true;
-							break;
-						}
-					}
-				}
+	// indexed by background pixel, transparent entries hold the background color
+	std::array<color_t, num_background_colors> background_colors;
+};
 
-				if (auto position = y * width + x; position < framebuffer.size()) framebuffer[position] = color;
-			}
+template<size_t NumPalettes>
+constexpr auto make_slot_palettes(color_t first) {
+	std::array<palette, NumPalettes> palettes{};
+	for (size_t i = 0; i < palettes.size(); ++i) {
+		for (size_t j = 0; j < palette::num_colors; ++j) {
+			palettes[i].colors[j] = static_cast<color_t>(first + i * palette::num_colors + j);
 		}
-		return true;
 	}
+	return palettes;
+}
 
-	void write_pattern(size_t pattern_table_index, size_t tile_index, std::span<pixel_t> &&src) {
-		get_pattern_table(pattern_table_index).write(tile_index, std::move(src));
-	}
+// palette indirect pixels, resolved to hardware colors after rendering
+// 0 is the background color, then 4 colors per background palette, then 4 per sprite palette
+struct palette_slot {
+	static constexpr color_t background_color = 0;
+	static constexpr color_t sprite_bit = background_plane::num_palettes * palette::num_colors;
+	static constexpr size_t num_slots = sprite_bit + sprite_plane::num_palettes * palette::num_colors;
 
-	void write_pattern(size_t pattern_table_index, std::span<pixel_t> &&src) {
-		get_pattern_table(pattern_table_index).write(std::move(src));
+	static constexpr color_t background(size_t palette_index, size_t palette_color_index) {
+		return static_cast<color_t>((palette_index % background_plane::num_palettes) * palette::num_colors + (palette_color_index % palette::num_colors));
 	}
 
-	void set_sprite_palette(size_t palette_index, size_t palette_color_index, color_t new_color) {
-		_sprite_plane.set_palette(palette_index, palette_color_index, new_color);
+	static constexpr color_t sprite(size_t palette_index, size_t palette_color_index) {
+		return static_cast<color_t>(sprite_bit + (palette_index % sprite_plane::num_palettes) * palette::num_colors + (palette_color_index % palette::num_colors));
 	}
 
-	void set_sprite_palette(size_t palette_index, color_t new_color1, color_t new_color2, color_t new_color3, color_t new_color4) {
-		_sprite_plane.set_palette(palette_index, 0, new_color1);
-		_sprite_plane.set_palette(palette_index, 1, new_color2);
-		_sprite_plane.set_palette(palette_index, 2, new_color3);
-		_sprite_plane.set_palette(palette_index, 3, new_color4);
-	}
+	// palettes that render slots in place of colors
+	static constexpr auto background_palettes = make_slot_palettes<background_plane::num_palettes>(0);
+	static constexpr auto sprite_palettes = make_slot_palettes<sprite_plane::num_palettes>(sprite_bit);
+};
 
-	void set_sprite_palette(size_t palette_index, color_t new_color2, color_t new_color3, color_t new_color4) {
-		set_sprite_palette(palette_index, 0, new_color2, new_color3, new_color4);
-	}
+using compose_kernel = void (*)(const scanline_layers &layers, std::span<color_t> out);
 
-	void set_sprite_palette(size_t palette_index, std::span<color_t> &&src) {
-		_sprite_plane.set_palette(palette_index, std::move(src));
-	}
+bool is_render_path_supported(render_path path);
+render_path detect_render_path();
+compose_kernel get_compose_kernel(render_path path);
 
-	void set_sprite_palette(std::span<color_t> &&src, size_t palette_index_offset = 0) {
-		_sprite_plane.set_palette(std::move(src), palette_index_offset);
-	}
+// hardware color indices to final pixels through a table of every hardware color
+constexpr size_t num_hardware_colors = std::numeric_limits<color_t>::max() + 1;
 
-	void set_sprite_pattern_table(index_t index) {
-		_sprite_plane.pattern_table_index = index % num_pattern_tables;
+using color_table = std::span<const uint32_t, num_hardware_colors>;
+
+template<typename Pixel>
+using expand_kernel = void (*)(std::span<const color_t> line, color_table colors, Pixel *out);
+
+expand_kernel<uint32_t> get_rgb32_kernel(render_path path);
+expand_kernel<uint16_t> get_rgb16_kernel(render_path path);
+
+template<typename Pixel>
+expand_kernel<Pixel> get_expand_kernel(render_path path) {
+	static_assert(std::is_same_v<Pixel, uint32_t> || std::is_same_v<Pixel, uint16_t>);
+	if constexpr (std::is_same_v<Pixel, uint16_t>) {
+		return get_rgb16_kernel(path);
+	} else {
+		return get_rgb32_kernel(path);
 	}
+}
 
-	void set_background_palette(size_t palette_index, size_t palette_color_index, color_t new_color) {
-		_background_plane.set_palette(palette_index, palette_color_index, new_color);
+struct raster_write {
+	enum target_t : uint8_t {
+		scroll_x,
+		scroll_y,
+		background_color,
+		background_pattern_table,
+		sprite_pattern_table,
+		background_palette,
+		sprite_palette,
+		pattern_bank,
+	};
+
+	coordinate_t x = 0;
+	coordinate_t y = 0;
+	target_t target = scroll_x;
+	index_t index = 0; // palette_index * palette::num_colors + palette_color_index, or the bank window
+	coordinate_t value = 0;
+
+	bool before(const raster_write &other) const {
+		return (y < other.y) || ((y == other.y) && (x < other.x));
 	}
+};
 
-	void set_background_palette(size_t palette_index, color_t new_color1, color_t new_color2, color_t new_color3, color_t new_color4) {
-		_background_plane.set_palette(palette_index, 0, new_color1);
-		_background_plane.set_palette(palette_index, 1, new_color2);
-		_background_plane.set_palette(palette_index, 2, new_color3);
-		_background_plane.set_palette(palette_index, 3, new_color4);
+struct raster_log {
+	std::vector<raster_write> writes;
+	bool sorted = true;
+	bool mid_line = false;
+
+	void clear() {
+		writes.clear();
+		sorted = true;
+		mid_line = false;
 	}
 
-	void set_background_palette(size_t palette_index, color_t new_color2, color_t new_color3, color_t new_color4) {
-		set_background_palette(palette_index, 0, new_color2, new_color3, new_color4);
+	void record(const raster_write &write) {
+		if (!writes.empty() && write.before(writes.back())) sorted = false;
+		if (write.x > 0) mid_line = true;
+		writes.push_back(write);
 	}
 
-	void set_background_palette(size_t palette_index, std::span<color_t> src) {
-		_background_plane.set_palette(palette_index, src);
+	void sort() {
+		if (sorted) return;
+		std::stable_sort(writes.begin(), writes.end(), [](auto &a, auto &b) { return a.before(b); });
+		sorted = true;
 	}
+};
 
-	void set_background_palette(std::span<color_t> &&src, size_t palette_index_offset = 0) {
-		_background_plane.set_palette(std::move(src), palette_index_offset);
+struct raster_state {
+	coordinate_t scroll_x = 0;
+	coordinate_t scroll_y = 0;
+	color_t background_color = 0;
+	index_t background_pattern_table_index = 0;
+	index_t sprite_pattern_table_index = 0;
+	std::array<palette, background_plane::num_palettes> background_palettes;
+	std::array<palette, sprite_plane::num_palettes> sprite_palettes;
+	pattern_banks banks;
+
+	void apply(const raster_write &write, size_t num_pattern_tables) {
+		auto palette_index = write.index / palette::num_colors;
+		auto palette_color_index = write.index % palette::num_colors;
+		switch (write.target) {
+		case raster_write::scroll_x: scroll_x = write.value; break;
+		case raster_write::scroll_y: scroll_y = write.value; break;
+		case raster_write::background_color: background_color = static_cast<color_t>(write.value); break;
+		case raster_write::background_pattern_table: background_pattern_table_index = static_cast<index_t>(write.value % num_pattern_tables); break;
+		case raster_write::sprite_pattern_table: sprite_pattern_table_index = static_cast<index_t>(write.value % num_pattern_tables); break;
+		case raster_write::background_palette: background_palettes[palette_index % background_palettes.size()].color(palette_color_index, static_cast<color_t>(write.value)); break;
+		case raster_write::sprite_palette: sprite_palettes[palette_index % sprite_palettes.size()].color(palette_color_index, static_cast<color_t>(write.value)); break;
+		case raster_write::pattern_bank: banks.windows[write.index % pattern_banks::num_windows] = static_cast<bank_index_t>(write.value); break;
+		}
 	}
 
-	void set_background_pattern_table(index_t index) {
-		_background_plane.pattern_table_index = index % num_pattern_tables;
+	// applies the writes from position up to and including scanline y
+	size_t apply(const raster_log &log, size_t position, coordinate_t y, size_t num_pattern_tables) {
+		for (; (position < log.writes.size()) && (log.writes[position].y <= y); ++position) {
+			apply(log.writes[position], num_pattern_tables);
+		}
+		return position;
 	}
+};
 
-	void set_background_color(color_t color) { _background_color = color; }
+template<typename T>
+concept render_output = requires(const T &output, coordinate_t y, size_t x, std::span<const color_t> colors) {
+	output.store(y, x, colors);
+};
 
-	void set_sprite(
-		size_t position,
-		coordinate_t x = 0,
-		coordinate_t y = 0,
-		index_t tile_index = 0xFF,
-		index_t palette_index = 0,
-		attribute_t attributes = 0
-	) {
-		_sprite_plane.set_sprite(position, x, y, tile_index, palette_index, attributes);
-	}
+// hardware color indices, width pixels per row
+struct indexed_output {
+	std::span<color_t> framebuffer;
+	size_t width = 0;
 
-	auto set_tile(size_t name_table_index, size_t x, size_t y, index_t index) {
-		_background_plane.set_tile(name_table_index, x, y, index);
+	void store(coordinate_t y, size_t x, std::span<const color_t> colors) const {
+		if (auto position = y * width + x; position < framebuffer.size()) {
+			std::copy_n(colors.begin(), std::min(colors.size(), framebuffer.size() - position), &framebuffer[position]);
+		}
 	}
+};
 
-	auto set_tile_palette(size_t name_table_index, size_t x, size_t y, index_t index) {
-		_background_plane.set_tile_palette(name_table_index, x, y, index);
-	}
+// final pixels converted through a color table, rows pitch bytes apart
+// 16 bit tables hold the pixel in the low half of each entry
+template<typename Pixel>
+struct direct_output {
+	void *pixels = nullptr;
+	size_t pitch = 0;
+	color_table colors;
+	expand_kernel<Pixel> expand = get_expand_kernel<Pixel>(render_path::automatic);
 
-	void set_scroll(coordinate_t x = 0, coordinate_t y = 0) {
-		scroll_x = x;
-		scroll_y = y;
+	void store(coordinate_t y, size_t x, std::span<const color_t> line) const {
+		auto *row = reinterpret_cast<Pixel *>(static_cast<uint8_t *>(pixels) + y * pitch) + x;
+		expand(line, colors, row);
 	}
+};
 
-	void set_callback(const callback &fn, attribute_t attr = vblank) { _callback = fn; _attribute = attr; }
+// palette slots, width pixels per row, see picture_processing_unit::resolve
+struct palette_indirect_output {
+	std::span<color_t> framebuffer;
+	size_t width = 0;
+
+	void store(coordinate_t y, size_t x, std::span<const color_t> colors) const {
+		indexed_output{ framebuffer, width }.store(y, x, colors);
+	}
+};
+
+using rgb32_output = direct_output<uint32_t>;
+using rgb16_output = direct_output<uint16_t>;
+
+// precomputed color tables for every display effect,
+// switching an effect swaps the table instead of adding work per pixel
+class palette_bank {
+public:
+	static constexpr size_t num_emphasis = 8;
+	static constexpr size_t num_brightness = 9;
+
+	struct effect {
+		static constexpr uint8_t emphasis_red = 0b001;
+		static constexpr uint8_t emphasis_green = 0b010;
+		static constexpr uint8_t emphasis_blue = 0b100;
+
+		bool grayscale = false;
+		uint8_t emphasis = 0;
+		uint8_t brightness = num_brightness - 1; // 0 is black
+
+		bool operator==(const effect &) const = default;
+	};
+
+	// rgb_colors are 0xRRGGBB, map converts r, g, b to the final pixel
+	template<typename Map>
+	palette_bank(std::span<const uint32_t> rgb_colors, Map &&map) : _tables(2 * num_emphasis * num_brightness) {
+		for (size_t grayscale = 0; grayscale < 2; ++grayscale) {
+			for (size_t emphasis = 0; emphasis < num_emphasis; ++emphasis) {
+				for (size_t brightness = 0; brightness < num_brightness; ++brightness) {
+					effect e{ grayscale != 0, static_cast<uint8_t>(emphasis), static_cast<uint8_t>(brightness) };
+					auto &table = _tables[index(e)];
+					for (size_t i = 0; i < table.size(); ++i) {
+						// grayscale keeps the column 0x0D-0x0F blacks
+						auto color_index = (e.grayscale && ((i & 0x0F) <= 0x0C)) ? (i & 0x30) : i;
+						if (color_index >= rgb_colors.size()) continue;
+						auto [r, g, b] = apply(e, rgb_colors[color_index]);
+						table[i] = static_cast<uint32_t>(map(r, g, b));
+					}
+				}
+			}
+		}
+	}
+
+	color_table get(const effect &e) const { return _tables[index(e)]; }
+
+private:
+	using table = std::array<uint32_t, num_hardware_colors>;
+
+	std::vector<table> _tables;
+
+	static size_t index(const effect &e) {
+		auto emphasis = e.emphasis % num_emphasis;
+		auto brightness = std::min<size_t>(e.brightness, num_brightness - 1);
+		return ((e.grayscale ? 1 : 0) * num_emphasis + emphasis) * num_brightness + brightness;
+	}
+
+	// emphasis darkens the channels that are not emphasized, brightness fades to black
+	static std::array<uint8_t, 3> apply(const effect &e, uint32_t rgb) {
+		std::array<uint32_t, 3> channels{ (rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF };
+		std::array<uint8_t, 3> result{};
+		for (size_t i = 0; i < channels.size(); ++i) {
+			auto value = channels[i];
+			if ((e.emphasis != 0) && ((e.emphasis & (1 << i)) == 0)) value = value * 3 / 4;
+			value = value * e.brightness / (num_brightness - 1);
+			result[i] = static_cast<uint8_t>(value);
+		}
+		return result;
+	}
+};
+
+class worker_pool {
+public:
+	using job = std::function<void(size_t)>;
+
+	explicit worker_pool(size_t num_threads) {
+		for (size_t i = 0; i < num_threads; ++i) {
+			_threads.emplace_back([this] { work(); });
+		}
+	}
+
+	~worker_pool() {
+		{
+			std::lock_guard lock(_mutex);
+			_quit = true;
+		}
+		_wake.notify_all();
+		for (auto &thread : _threads) thread.join();
+	}
+
+	worker_pool(const worker_pool &) = delete;
+	worker_pool &operator=(const worker_pool &) = delete;
+
+	auto size() const { return _threads.size(); }
+
+	// the calling thread takes jobs too, and returns once all of them are done
+	void run(size_t num_jobs, const job &fn) {
+		{
+			std::lock_guard lock(_mutex);
+			_job = &fn;
+			_num_jobs = num_jobs;
+			_next_job = 0;
+			_num_done = 0;
+			++_generation;
+		}
+		_wake.notify_all();
+		execute();
+
+		std::unique_lock lock(_mutex);
+		_done.wait(lock, [this] { return _num_done == _num_jobs; });
+		_job = nullptr;
+	}
+
+private:
+	void work() {
+		uint64_t generation = 0;
+		while (true) {
+			{
+				std::unique_lock lock(_mutex);
+				_wake.wait(lock, [&] { return _quit || (_generation != generation); });
+				if (_quit) break;
+				generation = _generation;
+			}
+			execute();
+		}
+	}
+
+	void execute() {
+		while (true) {
+			size_t index = 0;
+			{
+				std::lock_guard lock(_mutex);
+				if (_next_job >= _num_jobs) break;
+				index = _next_job++;
+			}
+			(*_job)(index);
+			{
+				std::lock_guard lock(_mutex);
+				if (++_num_done == _num_jobs) _done.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	const job *_job = nullptr;
+	size_t _num_jobs = 0;
+	size_t _next_job = 0;
+	size_t _num_done = 0;
+	uint64_t _generation = 0;
+	bool _quit = false;
+};
+
+// everything a console variant fixes at compile time, the screen size is what the
+// frontend renders at, the name tables wrap at their own size whatever it is
+template<size_t Width, size_t Height, mirror_mode Mirroring = mirror_mode::vertical, size_t NumSprites = sprite_plane::num_sprites, size_t SpriteLimit = sprite_plane::max_sprites_on_scanline, size_t MaxBackgroundLayers = 4>
+struct console_profile {
+	static constexpr size_t width = Width;
+	static constexpr size_t height = Height;
+	static constexpr mirror_mode mirroring = Mirroring;
+	static constexpr size_t num_sprites = NumSprites;
+	static constexpr size_t sprite_limit = SpriteLimit;
+	static constexpr size_t max_background_layers = MaxBackgroundLayers;
+
+	static_assert((num_sprites > 0) && (num_sprites <= sprite_plane::max_num_sprites));
+	static_assert(max_background_layers > 0);
+};
+
+using classic_profile = console_profile<256, 240>;
+using widescreen_profile = console_profile<384, 216, mirror_mode::four_screen>;
+
+template<typename Profile = classic_profile>
+class basic_picture_processing_unit {
+public:
+	using profile = Profile;
+	using background_plane = basic_background_plane<profile::mirroring>;
+	using background_cache = basic_background_cache<background_plane>;
+	using background_layer = basic_background_layer<background_plane>;
+
+	static constexpr size_t num_pattern_tables = pattern_banks::num_tables;
+	static constexpr size_t max_background_layers = profile::max_background_layers;
+
+	using callback = std::function<void(int, int)>;
+
+	enum attribute {
+		_vblank,
+		_hblank,
+		_always,
+
+		vblank = 1 << _vblank,
+		hblank = 1 << _hblank,
+		always = 1 << _always,
+	};
+
+	enum class callback_policy {
+		none,
+		vblank,
+		hblank,
+		always,
+	};
+
+	struct no_callback {
+		void operator()(int, int) const {}
+	};
+
+public:
+	basic_picture_processing_unit() {
+		_sprite_plane.resize(profile::num_sprites);
+		_sprite_plane.scanline_limit = profile::sprite_limit;
+	}
+
+	pattern_table get_pattern_table(size_t position) const {
+		return get_pattern_table(position, _pattern_banks);
+	}
+
+	pattern_table get_pattern_table(size_t position, const pattern_banks &banks) const {
+		return { _pattern_pool, &banks.windows[(position % num_pattern_tables) * pattern_table::num_windows] };
+	}
+
+	bool render(std::span<color_t> framebuffer, size_t width, size_t height) {
+		return render(indexed_output{ framebuffer, width }, width, height);
+	}
+
+	template<render_output Output>
+	bool render(const Output &output, size_t width, size_t height) {
+		if (!_callback) {
+			return render<callback_policy::none>(output, width, height, no_callback{});
+
+		} else if (update_timing(always)) {
+			return render<callback_policy::always>(output, width, height, _callback);
+
+		} else if (update_timing(hblank)) {
+			return render<callback_policy::hblank>(output, width, height, _callback);
+
+		} else if (update_timing(vblank)) {
+			return render<callback_policy::vblank>(output, width, height, _callback);
+		}
+		return render<callback_policy::none>(output, width, height, no_callback{});
+	}
+
+	template<callback_policy Policy, typename Callback>
+	bool render(std::span<color_t> framebuffer, size_t width, size_t height, Callback &&fn) {
+		return render<Policy>(indexed_output{ framebuffer, width }, width, height, fn);
+	}
+
+	template<callback_policy Policy, render_output Output, typename Callback>
+	bool render(const Output &output, size_t width, size_t height, Callback &&fn) {
+		_raster_log.sort();
+		sync_background_caches();
+
+		// palette slots do not change with the palettes
+		_palette_indirect = std::is_same_v<Output, palette_indirect_output>;
+		if (_colors_dirty && !_palette_indirect) invalidate_frame();
+		_colors_dirty = false;
+
+		if (_collision_detection) {
+			for (auto &buffers : _band_buffers) buffers.collisions.clear(_sprite_plane.size());
+		}
+
+		// only an indexed framebuffer is guaranteed to still hold the previous frame,
+		// and collisions need every pixel
+		if constexpr (std::is_same_v<Output, indexed_output> || std::is_same_v<Output, palette_indirect_output>) {
+			if ((Policy == callback_policy::none) && (_render_backend == render_backend::optimized) && _incremental && !_collision_detection && _raster_log.writes.empty()) {
+				render_incremental(indexed_output{ output.framebuffer, output.width }, width, height);
+				return true;
+			}
+		}
+
+		const auto &target = select_kernels(output);
+		if ((_render_backend == render_backend::reference) || (Policy == callback_policy::always) || _raster_log.mid_line) {
+			render_pixels<Policy>(target, width, height, fn);
+
+		} else {
+			render_scanlines<Policy>(target, width, height, fn);
+		}
+
+		if (_collision_detection) {
+			_collisions.clear(_sprite_plane.size());
+			for (auto &buffers : _band_buffers) _collisions.merge(buffers.collisions);
+			_collisions.finish();
+		}
+
+		// callbacks and raster writes leave state the next frame cannot diff against
+		_dirty_rects.assign(1, rect{ 0, 0, static_cast<coordinate_t>(width), static_cast<coordinate_t>(height) });
+		invalidate_frame();
+		return true;
+	}
+
+	// gathers sprite collisions while rendering, at the cost of incremental rendering
+	void set_collision_detection(bool enabled) {
+		_collision_detection = enabled;
+		_collisions.clear(0);
+	}
+
+	auto get_collision_detection() const { return _collision_detection; }
+
+	// found by the last render
+	auto &get_collisions() const { return _collisions; }
+
+	bool get_sprite_zero_hit(coordinate_t &out_x, coordinate_t &out_y) const {
+		out_x = _collisions.sprite_zero_x;
+		out_y = _collisions.sprite_zero_y;
+		return _collisions.sprite_zero_hit;
+	}
+
+	uint8_t get_sprite_collision(size_t position) const {
+		return (position < _collisions.flags.size()) ? _collisions.flags[position] : 0;
+	}
+
+	// hardware color of every palette slot with the current palettes
+	std::array<color_t, num_hardware_colors> get_slot_colors() const {
+		std::array<color_t, num_hardware_colors> colors{};
+		colors[palette_slot::background_color] = _background_color;
+		for (size_t i = 0; i < background_plane::num_palettes; ++i) {
+			for (size_t j = 1; j < palette::num_colors; ++j) {
+				colors[palette_slot::background(i, j)] = _background_plane.get_palette(i).color(j);
+			}
+		}
+		for (size_t i = 0; i < sprite_plane::num_palettes; ++i) {
+			for (size_t j = 1; j < palette::num_colors; ++j) {
+				colors[palette_slot::sprite(i, j)] = _sprite_plane.get_palette(i).color(j);
+			}
+		}
+		return colors;
+	}
+
+	// converts a palette indirect frame with the palettes as they are now,
+	// so palette writes between scanlines of that frame do not show
+	template<typename Pixel>
+	void resolve(const direct_output<Pixel> &output, std::span<const color_t> frame, size_t width, size_t height) const {
+		auto slots = get_slot_colors();
+		std::array<uint32_t, num_hardware_colors> colors;
+		for (size_t i = 0; i < colors.size(); ++i) {
+			colors[i] = output.colors[slots[i]];
+		}
+		direct_output<Pixel> resolved{ output.pixels, output.pitch, colors, select_kernels(output).expand };
+		for (size_t y = 0; (y < height) && ((y + 1) * width <= frame.size()); ++y) {
+			resolved.store(static_cast<coordinate_t>(y), 0, frame.subspan(y * width, width));
+		}
+	}
+
+	void resolve(const indexed_output &output, std::span<const color_t> frame, size_t width, size_t height) const {
+		auto slots = get_slot_colors();
+		std::vector<color_t> line(width);
+		for (size_t y = 0; (y < height) && ((y + 1) * width <= frame.size()); ++y) {
+			std::transform(&frame[y * width], &frame[y * width] + width, line.begin(), [&slots](color_t slot) { return slots[slot]; });
+			output.store(static_cast<coordinate_t>(y), 0, line);
+		}
+	}
+
+	// writes through the banks the table currently shows
+	void write_pattern(size_t pattern_table_index, size_t tile_index, std::span<pixel_t> &&src) {
+		auto num_patterns = (src.size() + pattern::num_pixels - 1) / pattern::num_pixels;
+		auto window = (pattern_table_index % num_pattern_tables) * pattern_table::num_windows;
+		for (size_t i = 0; i < num_patterns;) {
+			auto position = (tile_index + i) % pattern_table::num_patterns;
+			auto offset = position % pattern_table::bank_size;
+			auto num = std::min(pattern_table::bank_size - offset, num_patterns - i);
+			auto bank = _pattern_banks.windows[window + position / pattern_table::bank_size];
+			write_pattern_bank(bank, offset, src.subspan(i * pattern::num_pixels, std::min(num * pattern::num_pixels, src.size() - i * pattern::num_pixels)));
+			i += num;
+		}
+	}
+
+	// writes straight into the pool, patterns past the end of the bank continue in the next one
+	void write_pattern_bank(size_t bank, size_t tile_index, std::span<pixel_t> src) {
+		auto num_patterns = (src.size() + pattern::num_pixels - 1) / pattern::num_pixels;
+		for (size_t i = 0; i < num_patterns; ++i) {
+			auto position = (bank * pattern_table::bank_size + tile_index + i) % _pattern_pool.size();
+			_pattern_pool[position].write(src.subspan(i * pattern::num_pixels, std::min(pattern::num_pixels, src.size() - i * pattern::num_pixels)));
+		}
+		for (size_t i = 0; i < num_patterns;) {
+			auto position = (bank * pattern_table::bank_size + tile_index + i) % _pattern_pool.size();
+			auto offset = position % pattern_table::bank_size;
+			auto num = std::min(pattern_table::bank_size - offset, num_patterns - i);
+			invalidate_pattern_bank(position / pattern_table::bank_size, offset, num);
+			i += num;
+		}
+		invalidate_frame();
+	}
+
+	void write_pattern(size_t pattern_table_index, std::span<pixel_t> &&src) {
+		write_pattern(pattern_table_index, 0, std::move(src));
+	}
+
+	// in 1 KB banks, at least enough to back every window
+	void set_pattern_banks(size_t num_banks) {
+		num_banks = std::clamp<size_t>(num_banks, pattern_banks::num_windows, pattern_banks::max_num_banks);
+		_pattern_pool.resize(num_banks * pattern_table::bank_size);
+		for (auto &cache : _background_caches) cache.invalidate();
+		invalidate_frame();
+	}
+
+	auto get_pattern_banks() const { return _pattern_pool.size() / pattern_table::bank_size; }
+
+	// shows a pool bank in one of the windows, pattern_table::num_windows per table
+	void map_pattern_bank(size_t window, size_t bank) {
+		window %= pattern_banks::num_windows;
+		auto index = static_cast<bank_index_t>(std::min(bank, get_pattern_banks() - 1));
+		if (_pattern_banks.windows[window] == index) return;
+
+		_pattern_banks.windows[window] = index;
+		if (_cache_banks.windows[window] != index) {
+			_background_caches[window / pattern_table::num_windows].invalidate_patterns(_background_plane, (window % pattern_table::num_windows) * pattern_table::bank_size, pattern_table::bank_size);
+			_cache_banks.windows[window] = index;
+		}
+		invalidate_frame();
+	}
+
+	auto get_pattern_bank(size_t window) const { return _pattern_banks.windows[window % pattern_banks::num_windows]; }
+
+	void set_sprite_palette(size_t palette_index, size_t palette_color_index, color_t new_color) {
+		_sprite_plane.set_palette(palette_index, palette_color_index, new_color);
+		invalidate_colors();
+	}
+
+	void set_sprite_palette(size_t palette_index, color_t new_color1, color_t new_color2, color_t new_color3, color_t new_color4) {
+		_sprite_plane.set_palette(palette_index, 0, new_color1);
+		_sprite_plane.set_palette(palette_index, 1, new_color2);
+		_sprite_plane.set_palette(palette_index, 2, new_color3);
+		_sprite_plane.set_palette(palette_index, 3, new_color4);
+		invalidate_colors();
+	}
+
+	void set_sprite_palette(size_t palette_index, color_t new_color2, color_t new_color3, color_t new_color4) {
+		set_sprite_palette(palette_index, 0, new_color2, new_color3, new_color4);
+	}
+
+	void set_sprite_palette(size_t palette_index, std::span<color_t> &&src) {
+		_sprite_plane.set_palette(palette_index, std::move(src));
+		invalidate_colors();
+	}
+
+	void set_sprite_palette(std::span<color_t> &&src, size_t palette_index_offset = 0) {
+		_sprite_plane.set_palette(std::move(src), palette_index_offset);
+		invalidate_colors();
+	}
+
+	void set_sprite_pattern_table(index_t index) {
+		_sprite_plane.pattern_table_index = index % num_pattern_tables;
+		invalidate_frame();
+	}
+
+	void set_background_palette(size_t palette_index, size_t palette_color_index, color_t new_color) {
+		_background_plane.set_palette(palette_index, palette_color_index, new_color);
+		invalidate_colors();
+	}
+
+	void set_background_palette(size_t palette_index, color_t new_color1, color_t new_color2, color_t new_color3, color_t new_color4) {
+		_background_plane.set_palette(palette_index, 0, new_color1);
+		_background_plane.set_palette(palette_index, 1, new_color2);
+		_background_plane.set_palette(palette_index, 2, new_color3);
+		_background_plane.set_palette(palette_index, 3, new_color4);
+		invalidate_colors();
+	}
+
+	void set_background_palette(size_t palette_index, color_t new_color2, color_t new_color3, color_t new_color4) {
+		set_background_palette(palette_index, 0, new_color2, new_color3, new_color4);
+	}
+
+	void set_background_palette(size_t palette_index, std::span<color_t> src) {
+		_background_plane.set_palette(palette_index, src);
+		invalidate_colors();
+	}
+
+	void set_background_palette(std::span<color_t> &&src, size_t palette_index_offset = 0) {
+		_background_plane.set_palette(std::move(src), palette_index_offset);
+		invalidate_colors();
+	}
+
+	void set_background_pattern_table(index_t index) {
+		_background_plane.pattern_table_index = index % num_pattern_tables;
+		invalidate_frame();
+	}
+
+	void set_background_color(color_t color) {
+		_background_color = color;
+		invalidate_colors();
+	}
+
+	void set_sprite(
+		size_t position,
+		coordinate_t x = 0,
+		coordinate_t y = 0,
+		index_t tile_index = 0xFF,
+		index_t palette_index = 0,
+		attribute_t attributes = 0
+	) {
+		invalidate_sprite(_sprite_plane.get_sprite(position));
+		_sprite_plane.set_sprite(position, x, y, tile_index, palette_index, attributes);
+		invalidate_sprite(_sprite_plane.get_sprite(position));
+		_sprites_dirty = true;
+	}
+
+	// up to sprite_plane::max_num_sprites, new sprites start hidden
+	void set_sprite_count(size_t num_sprites) {
+		_sprite_plane.resize(num_sprites);
+		_sprites_dirty = true;
+		invalidate_frame();
+	}
+
+	auto get_sprite_count() const { return _sprite_plane.size(); }
+
+	// sprites per scanline, 0 for no limit
+	void set_sprite_limit(size_t limit) {
+		_sprite_plane.scanline_limit = limit;
+		_sprites_dirty = true;
+		invalidate_frame();
+	}
+
+	auto get_sprite_limit() const { return _sprite_plane.scanline_limit; }
+
+	auto set_tile(size_t name_table_index, size_t x, size_t y, index_t index) {
+		_background_plane.set_tile(name_table_index, x, y, index);
+		for (auto &cache : _background_caches) cache.invalidate_tile(name_table_index, x, y);
+		invalidate_tile(name_table_index, x, y);
+	}
+
+	auto set_tile_palette(size_t name_table_index, size_t x, size_t y, index_t index) {
+		_background_plane.set_tile_palette(name_table_index, x, y, index);
+		for (auto &cache : _background_caches) cache.invalidate_block(name_table_index, x, y);
+		auto left = x - (x % block::width);
+		auto top = y - (y % block::height);
+		for (size_t yy = top; yy < top + block::height; ++yy) {
+			for (size_t xx = left; xx < left + block::width; ++xx) {
+				invalidate_tile(name_table_index, xx, yy);
+			}
+		}
+	}
+
+	// tiles across the name tables, top to bottom from (x, y) and wrapping, palettes are optional
+	void set_tile_column(size_t x, size_t y, std::span<const index_t> tile_indices, std::span<const index_t> palette_indices = {}) {
+		for (size_t i = 0; i < tile_indices.size(); ++i) {
+			set_plane_tile(x, y + i, tile_indices[i], (i < palette_indices.size()) ? &palette_indices[i] : nullptr);
+		}
+	}
+
+	// tiles across the name tables, left to right from (x, y) and wrapping, palettes are optional
+	void set_tile_row(size_t x, size_t y, std::span<const index_t> tile_indices, std::span<const index_t> palette_indices = {}) {
+		for (size_t i = 0; i < tile_indices.size(); ++i) {
+			set_plane_tile(x + i, y, tile_indices[i], (i < palette_indices.size()) ? &palette_indices[i] : nullptr);
+		}
+	}
+
+	// everything a frame is rendered from, see render_pipeline
+	struct snapshot {
+		sprite_plane sprites;
+		background_plane background;
+		color_t background_color = 0;
+		std::vector<pattern> pattern_pool;
+		pattern_banks banks;
+		coordinate_t scroll_x = 0;
+		coordinate_t scroll_y = 0;
+		raster_log log;
+		bool collision_detection = false;
+		std::array<background_layer, max_background_layers - 1> layers;
+		int background_priority = 0;
+		bool background_transparent = true;
+	};
+
+	void save(snapshot &out) const {
+		out.sprites = _sprite_plane;
+		out.background = _background_plane;
+		out.background_color = _background_color;
+		out.pattern_pool = _pattern_pool;
+		out.banks = _pattern_banks;
+		out.scroll_x = scroll_x;
+		out.scroll_y = scroll_y;
+		out.log = _raster_log;
+		out.collision_detection = _collision_detection;
+		out.layers = _background_layers;
+		out.background_priority = _background_priority;
+		out.background_transparent = _background_transparent;
+	}
+
+	// nothing is known about what changed, so the next frame is rendered in full
+	void load(const snapshot &in) {
+		_sprite_plane = in.sprites;
+		_background_plane = in.background;
+		_background_color = in.background_color;
+		_pattern_pool = in.pattern_pool;
+		_pattern_banks = in.banks;
+		_cache_banks = in.banks;
+		scroll_x = in.scroll_x;
+		scroll_y = in.scroll_y;
+		_raster_log = in.log;
+		_collision_detection = in.collision_detection;
+		_background_layers = in.layers;
+		_background_priority = in.background_priority;
+		_background_transparent = in.background_transparent;
+		sort_layers();
+		for (auto &cache : _background_caches) cache.invalidate();
+		_sprites_dirty = true;
+		invalidate_frame();
+	}
+
+	// palettes are resolved after the cache, so palette writes never invalidate it
+	void set_background_cache(bool enabled) {
+		_background_cache_enabled = enabled;
+		for (auto &cache : _background_caches) {
+			cache.pixels.clear();
+			cache.valid_tiles.clear();
+			cache.num_invalid_tiles = 0;
+		}
+	}
+
+	auto get_background_cache() const { return _background_cache_enabled; }
+
+	// layer 0 is the main background and always enabled, higher priorities are drawn in front and
+	// ties keep the lower layer in front, an opaque layer covers the layers behind it with the backdrop,
+	// raster writes only reach the main background
+	void set_layer(size_t layer, bool enabled, int priority = 0, bool transparent = true) {
+		layer %= max_background_layers;
+		if (layer == 0) {
+			_background_priority = priority;
+			_background_transparent = transparent;
+		} else {
+			auto &it = _background_layers[layer - 1];
+			it.enabled = enabled;
+			it.priority = priority;
+			it.transparent = transparent;
+		}
+		sort_layers();
+		invalidate_frame();
+	}
+
+	void set_layer_scroll(size_t layer, coordinate_t x = 0, coordinate_t y = 0) {
+		layer %= max_background_layers;
+		if (layer == 0) return set_scroll(x, y);
+		auto &it = _background_layers[layer - 1];
+		if ((x != it.scroll_x) || (y != it.scroll_y)) invalidate_frame();
+		it.scroll_x = x;
+		it.scroll_y = y;
+	}
+
+	void set_layer_pattern_table(size_t layer, index_t index) {
+		layer %= max_background_layers;
+		if (layer == 0) return set_background_pattern_table(index);
+		_background_layers[layer - 1].plane.pattern_table_index = index % num_pattern_tables;
+		invalidate_frame();
+	}
+
+	void set_layer_tile(size_t layer, size_t name_table_index, size_t x, size_t y, index_t index) {
+		layer %= max_background_layers;
+		if (layer == 0) return set_tile(name_table_index, x, y, index);
+		_background_layers[layer - 1].plane.set_tile(name_table_index, x, y, index);
+		invalidate_frame();
+	}
+
+	void set_layer_tile_palette(size_t layer, size_t name_table_index, size_t x, size_t y, index_t index) {
+		layer %= max_background_layers;
+		if (layer == 0) return set_tile_palette(name_table_index, x, y, index);
+		_background_layers[layer - 1].plane.set_tile_palette(name_table_index, x, y, index);
+		invalidate_frame();
+	}
+
+	void set_scroll(coordinate_t x = 0, coordinate_t y = 0) {
+		if ((x != scroll_x) || (y != scroll_y)) invalidate_frame();
+		scroll_x = x;
+		scroll_y = y;
+	}
+
+	// re-renders only the 8x8 screen cells touched since the previous frame into the same framebuffer
+	void set_incremental(bool enabled) {
+		_incremental = enabled;
+		invalidate_frame();
+	}
+
+	auto get_incremental() const { return _incremental; }
+
+	// screen areas changed by the last render
+	std::span<const rect> get_dirty_rects() const { return _dirty_rects; }
+
+	bool set_render_path(render_path path) {
+		if (!is_render_path_supported(path)) return false;
+		_render_path = path;
+		_compose_kernel = get_compose_kernel(path);
+		return true;
+	}
+
+	void set_render_backend(render_backend backend) {
+		_render_backend = backend;
+		invalidate_frame();
+	}
+
+	auto get_render_backend() const { return _render_backend; }
+
+	void set_render_threads(size_t num_threads) {
+		if (num_threads > 1) {
+			_workers = std::make_unique<worker_pool>(num_threads - 1);
+		} else {
+			_workers.reset();
+		}
+	}
+
+	auto get_render_threads() const { return _workers ? (_workers->size() + 1) : 1; }
+
+	auto get_render_path() const { return (_render_path == render_path::automatic) ? detect_render_path() : _render_path; }
+
+	// the reference backend always runs the scalar kernels, so it cannot share a vector kernel bug with the optimized one
+	render_path get_kernel_path() const { return (_render_backend == render_backend::reference) ? render_path::scalar : _render_path; }
+
+	// a path other than automatic also replaces the expand kernel of direct outputs
+	template<render_output Output>
+	const Output &select_kernels(const Output &output) const { return output; }
+
+	template<typename Pixel>
+	direct_output<Pixel> select_kernels(const direct_output<Pixel> &output) const {
+		auto selected = output;
+		if (auto path = get_kernel_path(); path != render_path::automatic) selected.expand = get_expand_kernel<Pixel>(path);
+		return selected;
+	}
+
+	void record_raster_write(const raster_write &write) { _raster_log.record(write); }
+
+	void record_scroll(coordinate_t y, coordinate_t x_scroll = 0, coordinate_t y_scroll = 0) {
+		record_raster_write({ 0, y, raster_write::scroll_x, 0, x_scroll });
+		record_raster_write({ 0, y, raster_write::scroll_y, 0, y_scroll });
+	}
+
+	void record_background_color(coordinate_t y, color_t color) {
+		record_raster_write({ 0, y, raster_write::background_color, 0, color });
+	}
+
+	void record_background_pattern_table(coordinate_t y, index_t index) {
+		record_raster_write({ 0, y, raster_write::background_pattern_table, 0, index });
+	}
+
+	void record_sprite_pattern_table(coordinate_t y, index_t index) {
+		record_raster_write({ 0, y, raster_write::sprite_pattern_table, 0, index });
+	}
+
+	void record_background_palette(coordinate_t y, size_t palette_index, size_t palette_color_index, color_t new_color) {
+		auto index = static_cast<index_t>((palette_index % background_plane::num_palettes) * palette::num_colors + (palette_color_index % palette::num_colors));
+		record_raster_write({ 0, y, raster_write::background_palette, index, new_color });
+	}
+
+	void record_sprite_palette(coordinate_t y, size_t palette_index, size_t palette_color_index, color_t new_color) {
+		auto index = static_cast<index_t>((palette_index % sprite_plane::num_palettes) * palette::num_colors + (palette_color_index % palette::num_colors));
+		record_raster_write({ 0, y, raster_write::sprite_palette, index, new_color });
+	}
+
+	void record_pattern_bank(coordinate_t y, size_t window, size_t bank) {
+		auto index = static_cast<index_t>(window % pattern_banks::num_windows);
+		record_raster_write({ 0, y, raster_write::pattern_bank, index, static_cast<coordinate_t>(std::min(bank, get_pattern_banks() - 1)) });
+	}
+
+	void clear_raster_log() { _raster_log.clear(); }
+
+	auto &get_raster_log() const { return _raster_log; }
+
+	void set_callback(const callback &fn, attribute_t attr = vblank) { _callback = fn; _attribute = attr; }
 
 	void invoke_callback(int x, int y) { if (_callback) _callback(x, y); }
 
 	bool update_timing(attribute_t attr) { return (_attribute & attr) != 0; }
 
 private:
+	struct scanline_buffers {
+		std::vector<pixel_t> background_line;
+		std::vector<pixel_t> layer_line;
+		sprite_plane::line_buffer sprite_front_line;
+		sprite_plane::line_buffer sprite_back_line;
+		std::vector<color_t> color_line;
+		raster_state state;
+		size_t raster_position = 0;
+
+		collision_report collisions;
+		std::vector<std::tuple<coordinate_t, uint8_t, sprite_index_t>> collision_sprites;
+
+		void resize(size_t width) {
+			if (color_line.size() == width) return;
+			background_line.resize(width);
+			layer_line.resize(width);
+			sprite_front_line.resize(width);
+			sprite_back_line.resize(width);
+			color_line.resize(width);
+		}
+	};
+
+	template<callback_policy Policy, render_output Output, typename Callback>
+	void render_pixels(const Output &output, size_t width, size_t height, Callback &fn) {
+		std::vector<sprite_index_t> line_sprites;
+		sprite_plane::scanline sprites;
+		bool sprites_changed = false;
+		size_t raster_position = 0;
+
+		if (_band_buffers.empty()) _band_buffers.resize(1);
+		_band_buffers.front().resize(width);
+		auto &line = _band_buffers.front().color_line;
+
+		for (int y = 0; y < height; ++y) {
+			auto num_line_sprites = _sprite_plane.find_sprites(y, line_sprites, get_kernel_path());
+
+			for (int x = 0; x < width; ++x) {
+				if constexpr (Policy == callback_policy::always) {
+					fn(x, y);
+				} else if constexpr (Policy == callback_policy::hblank) {
+					if (x == 0) fn(x, y);
+				} else if constexpr (Policy == callback_policy::vblank) {
+					if ((x == 0) && (y == 0)) fn(x, y);
+				}
+				raster_position = apply_raster_log(raster_position, x, y);
+
+				if constexpr (Policy != callback_policy::none) {
+					if (_sprites_dirty) {
+						num_line_sprites = _sprite_plane.find_sprites(y, line_sprites, get_kernel_path());
+						_sprites_dirty = false;
+						sprites_changed = true;
+					}
+				}
+
+				sprites.clear();
+				for (size_t i = 0; i < num_line_sprites; ++i) {
+					auto sprite = _sprite_plane.get_sprite(line_sprites[i]);
+					if ((x >= sprite.left()) && (x < sprite.right())) sprites.push(sprite.attributes, line_sprites[i]);
+				}
+
+				auto xx = x + (scroll_x % static_cast<int>(background_plane::full_pixel_width));
+				auto yy = y + (scroll_y % static_cast<int>(background_plane::full_pixel_height));
+				if (xx < 0) xx += static_cast<int>(background_plane::full_pixel_width);
+				if (yy < 0) yy += static_cast<int>(background_plane::full_pixel_height);
+
+				auto color = _palette_indirect ? palette_slot::background_color : _background_color;
+				bool found_color = find_sprite_color(sprites.front(), x, y, color);
+
+				auto background = (_num_layers > 1) ? get_background_pixel(x, y) : get_layer_pixel(_background_plane, xx, yy);
+				if (!found_color) {
+					auto pixel = static_cast<pixel_t>(background & pattern::pixel_mask);
+					auto palette_index = background >> pattern::bits_per_pixel;
+					if (pixel > 0) {
+						color = _palette_indirect ? palette_slot::background(palette_index, pixel) : _background_plane.get_palette(palette_index).color(pixel);
+						found_color = true;
+					}
+				}
+
+				if (!found_color) {
+					found_color = find_sprite_color(sprites.back(), x, y, color);
+				}
+
+				line[x] = color;
+
+				if (_collision_detection) {
+					auto background_opaque = (background & pattern::pixel_mask) > 0;
+					detect_pixel_collisions(sprites, x, y, background_opaque, _band_buffers.front());
+				}
+			}
+
+			output.store(y, 0, line);
+		}
+
+		apply_raster_log(raster_position, 0, std::numeric_limits<coordinate_t>::max());
+
+		// the bins were not kept up to date while the callback moved sprites
+		if (sprites_changed) _sprites_dirty = true;
+	}
+
+	template<callback_policy Policy, render_output Output, typename Callback>
+	void render_scanlines(const Output &output, size_t width, size_t height, Callback &fn) {
+		if (_sprite_scanlines.size() != height) {
+			_sprite_scanlines.resize(height);
+			_sprites_dirty = true;
+		}
+		if (_sprites_dirty) {
+			_sprite_plane.bin_sprites(_sprite_scanlines);
+			_sprites_dirty = false;
+		}
+
+		// without hblank callbacks a band only needs the state replayed up to its first scanline
+		if ((Policy != callback_policy::hblank) && _workers) {
+			if constexpr (Policy == callback_policy::vblank) {
+				fn(0, 0);
+				if (_sprites_dirty) {
+					_sprite_plane.bin_sprites(_sprite_scanlines);
+					_sprites_dirty = false;
+				}
+			}
+
+			auto num_bands = std::min(_workers->size() + 1, std::max<size_t>(height, 1));
+			auto band_height = (height + num_bands - 1) / num_bands;
+			if (_band_buffers.size() < num_bands) _band_buffers.resize(num_bands);
+
+			auto state = get_raster_state();
+			size_t raster_position = 0;
+			for (size_t band = 0; band < num_bands; ++band) {
+				auto &buffers = _band_buffers[band];
+				buffers.state = state;
+				buffers.raster_position = raster_position;
+				raster_position = state.apply(_raster_log, raster_position, static_cast<coordinate_t>((band + 1) * band_height) - 1, num_pattern_tables);
+			}
+
+			// bands only read the cache, so every table a band may switch to is decoded up front
+			if (_background_cache_enabled) {
+				for (size_t i = 0; i < num_pattern_tables; ++i) validate_background_cache(i);
+			}
+
+			_workers->run(num_bands, [&](size_t band) {
+				auto first_line = band * band_height;
+				auto last_line = std::min(first_line + band_height, height);
+				auto &buffers = _band_buffers[band];
+				buffers.resize(width);
+				for (auto y = first_line; y < last_line; ++y) {
+					buffers.raster_position = buffers.state.apply(_raster_log, buffers.raster_position, static_cast<coordinate_t>(y), num_pattern_tables);
+					render_scanline(output, width, static_cast<coordinate_t>(y), buffers);
+				}
+			});
+
+			state.apply(_raster_log, raster_position, std::numeric_limits<coordinate_t>::max(), num_pattern_tables);
+			set_raster_state(state);
+			return;
+		}
+
+		if (_band_buffers.empty()) _band_buffers.resize(1);
+		auto &buffers = _band_buffers.front();
+		buffers.resize(width);
+		bool sprites_changed = false;
+		size_t raster_position = 0;
+
+		for (int y = 0; y < height; ++y) {
+			bool update = (Policy == callback_policy::hblank) || ((Policy == callback_policy::vblank) && (y == 0));
+			if (update) {
+				fn(0, y);
+
+				// re-bin only the scanlines that follow an OAM write
+				if (_sprites_dirty) {
+					_sprite_plane.bin_sprites(_sprite_scanlines, y);
+					_sprites_dirty = false;
+					sprites_changed = (y > 0);
+				}
+			}
+
+			// recorded writes land after the callback of their scanline
+			buffers.state = get_raster_state();
+			raster_position = buffers.state.apply(_raster_log, raster_position, y, num_pattern_tables);
+			set_raster_state(buffers.state);
+
+			if (_background_cache_enabled) validate_background_cache(buffers.state.background_pattern_table_index);
+
+			render_scanline(output, width, y, buffers);
+		}
+
+		apply_raster_log(raster_position, 0, std::numeric_limits<coordinate_t>::max());
+
+		// scanlines above the last re-bin still reflect the previous OAM
+		if (sprites_changed) _sprites_dirty = true;
+	}
+
+	template<render_output Output>
+	void render_scanline(const Output &output, size_t width, coordinate_t y, scanline_buffers &buffers) const {
+		render_scanline_span(y, 0, width, buffers);
+		output.store(y, 0, buffers.color_line);
+	}
+
+	// composes the whole line, but only [begin, end) of the background is decoded
+	void render_scanline_span(coordinate_t y, size_t begin, size_t end, scanline_buffers &buffers) const {
+		auto &sprites = _sprite_scanlines[y];
+		if (_num_layers > 1) {
+			render_layers_scanline(y, begin, end, buffers);
+		} else {
+			render_background_scanline(y, begin, end, buffers.state, buffers.background_line);
+		}
+		render_sprite_scanline(sprites.front(), y, buffers.state, buffers.sprite_front_line);
+		render_sprite_scanline(sprites.back(), y, buffers.state, buffers.sprite_back_line);
+		compose_scanline(buffers);
+		if (_collision_detection) detect_collisions(y, sprites, buffers);
+	}
+
+	void detect_pixel_collisions(const sprite_plane::scanline &sprites, coordinate_t x, coordinate_t y, bool background_opaque, scanline_buffers &buffers) const {
+		auto table = get_pattern_table(_sprite_plane.pattern_table_index);
+		auto &report = buffers.collisions;
+		if (report.flags.size() != _sprite_plane.size()) report.clear(_sprite_plane.size());
+
+		auto &opaque = buffers.collision_sprites;
+		opaque.clear();
+		for (auto bin : { sprites.front(), sprites.back() }) {
+			for (auto position : bin) {
+				auto sprite = _sprite_plane.get_sprite(position);
+				if (table.get_pixel(sprite.tile_index, sprite.column(x), sprite.row(y)) == 0) continue;
+
+				if (background_opaque) {
+					report.flags[position] |= collision_report::background;
+					if (position == 0) report.hit_zero(x, y);
+				}
+				for (auto &other : opaque) report.hit_pair(std::get<2>(other), position);
+				opaque.emplace_back(x, 0, position);
+			}
+		}
+	}
+
+	// the opaque bits of every sprite on the line against the background and each other
+	void detect_collisions(coordinate_t y, const sprite_plane::scanline &sprites, scanline_buffers &buffers) const {
+		auto table = get_pattern_table(buffers.state.sprite_pattern_table_index, buffers.state.banks);
+		auto &report = buffers.collisions;
+		if (report.flags.size() != _sprite_plane.size()) report.clear(_sprite_plane.size());
+		auto width = static_cast<coordinate_t>(buffers.background_line.size());
+
+		auto &line = buffers.collision_sprites;
+		line.clear();
+		for (auto bin : { sprites.front(), sprites.back() }) {
+			for (auto position : bin) {
+				auto sprite = _sprite_plane.get_sprite(position);
+				auto bits = table.get_pattern(sprite.tile_index).opaque_bits(sprite.row(y), sprite.has_attribute(sprite::flip_horizontally));
+
+				// pixels off the line never collide
+				if (sprite.x < 0) bits &= static_cast<uint8_t>(0xFF >> std::min<coordinate_t>(-sprite.x, pattern::width));
+				if (sprite.x + static_cast<coordinate_t>(pattern::width) > width) bits &= static_cast<uint8_t>(0xFF << std::min<coordinate_t>(sprite.x + static_cast<coordinate_t>(pattern::width) - width, pattern::width));
+				if (bits == 0) continue;
+
+				for (coordinate_t i = 0; i < static_cast<coordinate_t>(pattern::width); ++i) {
+					if ((bits & (0x80 >> i)) && (buffers.background_line[sprite.x + i] & pattern::pixel_mask)) {
+						report.flags[position] |= collision_report::background;
+						if (position == 0) report.hit_zero(sprite.x + i, y);
+						break;
+					}
+				}
+				line.emplace_back(sprite.x, bits, position);
+			}
+		}
+
+		// sorted by x, only sprites less than a pattern apart can overlap
+		std::sort(line.begin(), line.end());
+		for (size_t i = 0; i < line.size(); ++i) {
+			auto [x, bits, position] = line[i];
+			for (auto j = i + 1; (j < line.size()) && (std::get<0>(line[j]) - x < static_cast<coordinate_t>(pattern::width)); ++j) {
+				auto [other_x, other_bits, other_position] = line[j];
+				if (static_cast<uint8_t>(bits << (other_x - x)) & other_bits) report.hit_pair(position, other_position);
+			}
+		}
+	}
+
+	void render_incremental(const indexed_output &output, size_t width, size_t height) {
+		auto framebuffer = output.framebuffer;
+		if ((_frame_width != width) || (_frame_height != height) || (_frame_data != framebuffer.data()) || (_frame_size != framebuffer.size()) || (_frame_indirect != _palette_indirect)) {
+			_frame_indirect = _palette_indirect;
+			_frame_width = width;
+			_frame_height = height;
+			_frame_data = framebuffer.data();
+			_frame_size = framebuffer.size();
+			_cell_width = (width + pattern::width - 1) / pattern::width;
+			_cell_height = (height + pattern::height - 1) / pattern::height;
+			_dirty_cells.assign(_cell_width * _cell_height, 0);
+			_frame_dirty = true;
+		}
+
+		if (_sprites_dirty || (_sprite_scanlines.size() != height)) {
+			_previous_sprite_scanlines = _sprite_scanlines;
+			_sprite_scanlines.resize(height);
+			_sprite_plane.bin_sprites(_sprite_scanlines);
+			_sprites_dirty = false;
+
+			// sprites dropped or let in by the per-line limit changed too
+			if (!_frame_dirty && (_previous_sprite_scanlines.size() == height)) {
+				for (size_t y = 0; y < height; ++y) {
+					auto &line = _sprite_scanlines[y];
+					auto &previous = _previous_sprite_scanlines[y];
+					if (line == previous) continue;
+					for (auto bin : { line.front(), line.back(), previous.front(), previous.back() }) {
+						for (auto position : bin) {
+							invalidate_rect(_sprite_plane.get_sprite(position).x, static_cast<coordinate_t>(y), pattern::width, 1);
+						}
+					}
+				}
+			}
+		}
+
+		_dirty_rects.clear();
+		if (_frame_dirty) {
+			no_callback fn;
+			render_scanlines<callback_policy::none>(output, width, height, fn);
+			_dirty_rects.push_back({ 0, 0, static_cast<coordinate_t>(width), static_cast<coordinate_t>(height) });
+			std::fill(_dirty_cells.begin(), _dirty_cells.end(), 0);
+			_frame_dirty = false;
+			return;
+		}
+
+		if (_band_buffers.empty()) _band_buffers.resize(1);
+		auto &buffers = _band_buffers.front();
+		buffers.resize(width);
+		buffers.state = get_raster_state();
+		if (_background_cache_enabled) validate_background_cache(buffers.state.background_pattern_table_index);
+
+		for (size_t cell_y = 0; cell_y < _cell_height; ++cell_y) {
+			auto *cells = &_dirty_cells[cell_y * _cell_width];
+			auto first_rect = _dirty_rects.size();
+			for (size_t cell_x = 0; cell_x < _cell_width;) {
+				if (!cells[cell_x]) {
+					++cell_x;
+					continue;
+				}
+				auto run = cell_x;
+				while ((cell_x < _cell_width) && cells[cell_x]) cells[cell_x++] = 0;
+
+				auto left = run * pattern::width;
+				auto right = std::min(cell_x * pattern::width, width);
+				auto top = cell_y * pattern::height;
+				auto bottom = std::min(top + pattern::height, height);
+				_dirty_rects.push_back({ static_cast<coordinate_t>(left), static_cast<coordinate_t>(top), static_cast<coordinate_t>(right - left), static_cast<coordinate_t>(bottom - top) });
+			}
+			if (first_rect == _dirty_rects.size()) continue;
+
+			auto begin = static_cast<size_t>(_dirty_rects[first_rect].x);
+			auto end = static_cast<size_t>(_dirty_rects.back().x + _dirty_rects.back().width);
+			for (auto y = cell_y * pattern::height; y < std::min((cell_y + 1) * pattern::height, height); ++y) {
+				render_scanline_span(static_cast<coordinate_t>(y), begin, end, buffers);
+				for (auto i = first_rect; i < _dirty_rects.size(); ++i) {
+					auto &area = _dirty_rects[i];
+					output.store(static_cast<coordinate_t>(y), area.x, std::span{ &buffers.color_line[area.x], static_cast<size_t>(area.width) });
+				}
+			}
+		}
+	}
+
+	void invalidate_frame() { _frame_dirty = true; }
+
+	// palette writes only change frames that hold hardware colors
+	void invalidate_colors() { _colors_dirty = true; }
+
+	void invalidate_rect(coordinate_t x, coordinate_t y, coordinate_t width, coordinate_t height) {
+		if (!_incremental || _frame_dirty || _dirty_cells.empty()) return;
+
+		auto left = std::max<coordinate_t>(x, 0);
+		auto top = std::max<coordinate_t>(y, 0);
+		auto right = std::min<coordinate_t>(x + width, static_cast<coordinate_t>(_frame_width));
+		auto bottom = std::min<coordinate_t>(y + height, static_cast<coordinate_t>(_frame_height));
+		if ((left >= right) || (top >= bottom)) return;
+
+		for (auto cell_y = top / pattern::height; cell_y <= (bottom - 1) / pattern::height; ++cell_y) {
+			for (auto cell_x = left / pattern::width; cell_x <= (right - 1) / pattern::width; ++cell_x) {
+				_dirty_cells[cell_y * _cell_width + cell_x] = 1;
+			}
+		}
+	}
+
+	void invalidate_sprite(const sprite &it) {
+		if (it.tile_index != 0xFF) invalidate_rect(it.left(), it.top(), pattern::width, pattern::height);
+	}
+
+	// every place the tile shows up on screen at the current scroll
+	void invalidate_tile(size_t name_table_index, size_t x, size_t y) {
+		if (!_incremental || _frame_dirty || _dirty_cells.empty()) return;
+
+		constexpr auto full_pixel_width = static_cast<coordinate_t>(background_plane::full_pixel_width);
+		constexpr auto full_pixel_height = static_cast<coordinate_t>(background_plane::full_pixel_height);
+
+		auto position = name_table_index % background_plane::num_name_tables;
+		auto tile_x = static_cast<coordinate_t>((position % background_plane::width) * background_plane::pixel_width + (x % tile_table::width) * pattern::width);
+		auto tile_y = static_cast<coordinate_t>((position / background_plane::width) * background_plane::pixel_height + (y % tile_table::height) * pattern::height);
+
+		auto screen_x = (tile_x - (scroll_x % full_pixel_width)) % full_pixel_width;
+		auto screen_y = (tile_y - (scroll_y % full_pixel_height)) % full_pixel_height;
+		if (screen_x < 0) screen_x += full_pixel_width;
+		if (screen_y < 0) screen_y += full_pixel_height;
+
+		for (auto yy = screen_y - full_pixel_height; yy < static_cast<coordinate_t>(_frame_height); yy += full_pixel_height) {
+			for (auto xx = screen_x - full_pixel_width; xx < static_cast<coordinate_t>(_frame_width); xx += full_pixel_width) {
+				invalidate_rect(xx, yy, pattern::width, pattern::height);
+			}
+		}
+	}
+
+	void set_plane_tile(size_t x, size_t y, index_t index, const index_t *palette_index) {
+		x %= tile_table::width * background_plane::width;
+		y %= tile_table::height * background_plane::height;
+		auto name_table_index = (y / tile_table::height) * background_plane::width + (x / tile_table::width);
+		auto name_x = x % tile_table::width;
+		auto name_y = y % tile_table::height;
+		set_tile(name_table_index, name_x, name_y, index);
+		if (palette_index) set_tile_palette(name_table_index, name_x, name_y, *palette_index);
+	}
+
+	raster_state get_raster_state() const {
+		return {
+			scroll_x,
+			scroll_y,
+			_background_color,
+			_background_plane.pattern_table_index,
+			_sprite_plane.pattern_table_index,
+			_background_plane.palettes,
+			_sprite_plane.palettes,
+			_pattern_banks,
+		};
+	}
+
+	void set_raster_state(const raster_state &state) {
+		scroll_x = state.scroll_x;
+		scroll_y = state.scroll_y;
+		_background_color = state.background_color;
+		_background_plane.pattern_table_index = state.background_pattern_table_index;
+		_sprite_plane.pattern_table_index = state.sprite_pattern_table_index;
+		_background_plane.palettes = state.background_palettes;
+		_sprite_plane.palettes = state.sprite_palettes;
+		_pattern_banks = state.banks;
+	}
+
+	// applies the writes from position up to and including (x, y)
+	size_t apply_raster_log(size_t position, coordinate_t x, coordinate_t y) {
+		auto &writes = _raster_log.writes;
+		raster_write at{ x, y };
+		if ((position >= writes.size()) || at.before(writes[position])) return position;
+
+		auto state = get_raster_state();
+		for (; (position < writes.size()) && !at.before(writes[position]); ++position) {
+			state.apply(writes[position], num_pattern_tables);
+		}
+		set_raster_state(state);
+		return position;
+	}
+
+	bool find_sprite_color(std::span<const sprite_index_t> sprites, coordinate_t x, coordinate_t y, color_t &out_color) const {
+		auto table = get_pattern_table(_sprite_plane.pattern_table_index);
+		for (auto position : sprites) {
+			auto sprite = _sprite_plane.get_sprite(position);
+			if ((x < sprite.left()) || (x >= sprite.right())) continue;
+			if (auto pixel = table.get_pixel(sprite.tile_index, sprite.column(x), sprite.row(y)); pixel > 0) {
+				out_color = _palette_indirect ? palette_slot::sprite(sprite.palette_index, pixel) : _sprite_plane.get_palette(sprite.palette_index).color(pixel);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void render_sprite_scanline(std::span<const sprite_index_t> sprites, coordinate_t y, const raster_state &state, sprite_plane::line_buffer &line) const {
+		auto table = get_pattern_table(state.sprite_pattern_table_index, state.banks);
+		auto &palettes = _palette_indirect ? palette_slot::sprite_palettes : state.sprite_palettes;
+		line.clear();
+		for (auto position : sprites) {
+			auto sprite = _sprite_plane.get_sprite(position);
+			auto &pattern = table.get_pattern(sprite.tile_index);
+			// flips are resolved once per sprite and scanline, never per pixel
+			auto row_y = sprite.row(y);
+			auto flip = sprite.has_attribute(sprite::flip_horizontally);
+			if (auto bits = pattern.opaque_bits(row_y, flip); bits != 0) {
+				line.blit(sprite.x, pattern.row(row_y, flip), bits, palettes[sprite.palette_index % sprite_plane::num_palettes]);
+			}
+		}
+	}
+
+	void compose_scanline(scanline_buffers &buffers) const {
+		scanline_layers layers{
+			buffers.background_line,
+			buffers.sprite_front_line.opaque,
+			buffers.sprite_front_line.colors,
+			buffers.sprite_back_line.opaque,
+			buffers.sprite_back_line.colors,
+		};
+		auto &palettes = _palette_indirect ? palette_slot::background_palettes : buffers.state.background_palettes;
+		auto background_color = _palette_indirect ? palette_slot::background_color : buffers.state.background_color;
+		for (size_t i = 0; i < layers.background_colors.size(); ++i) {
+			auto &color = layers.background_colors[i];
+			if ((i & pattern::pixel_mask) > 0) {
+				color = palettes[(i >> pattern::bits_per_pixel) % background_plane::num_palettes].color(i);
+			} else {
+				color = background_color;
+			}
+		}
+		_compose_kernel(layers, buffers.color_line);
+	}
+
+	void validate_background_cache(size_t pattern_table_index) {
+		auto position = pattern_table_index % num_pattern_tables;
+		_background_caches[position].validate(_background_plane, get_pattern_table(position, _cache_banks));
+	}
+
+	// banks remapped by raster writes or a snapshot since the caches were decoded
+	void sync_background_caches() {
+		if (_cache_banks == _pattern_banks) return;
+		for (auto &cache : _background_caches) cache.invalidate();
+		_cache_banks = _pattern_banks;
+	}
+
+	void invalidate_pattern_bank(size_t bank, size_t tile_index, size_t num_patterns) {
+		for (size_t window = 0; window < pattern_banks::num_windows; ++window) {
+			if (_cache_banks.windows[window] != bank) continue;
+			auto first = (window % pattern_table::num_windows) * pattern_table::bank_size + tile_index;
+			_background_caches[window / pattern_table::num_windows].invalidate_patterns(_background_plane, first, num_patterns);
+		}
+	}
+
+	void render_background_scanline(coordinate_t y, size_t begin, size_t end, const raster_state &state, std::span<pixel_t> line) const {
+		constexpr auto full_pixel_width = static_cast<int>(background_plane::full_pixel_width);
+		constexpr auto full_pixel_height = static_cast<int>(background_plane::full_pixel_height);
+
+		auto xx = (state.scroll_x % full_pixel_width) + static_cast<coordinate_t>(begin % full_pixel_width);
+		auto yy = y + (state.scroll_y % full_pixel_height);
+		if (xx < 0) xx += full_pixel_width;
+		if (yy < 0) yy += full_pixel_height;
+		xx %= full_pixel_width;
+
+		// lines with banks switched mid-frame decode straight from the pool
+		if (_background_cache_enabled && (state.banks == _cache_banks)) {
+			_background_caches[state.background_pattern_table_index % num_pattern_tables].copy_row(xx, yy, line.subspan(begin, end - begin));
+			return;
+		}
+
+		decode_background_row(_background_plane, get_pattern_table(state.background_pattern_table_index, state.banks), xx, yy, begin, end, line);
+	}
+
+	// one span per tile, partial spans at both edges
+	static void decode_background_row(const background_plane &plane, pattern_table table, coordinate_t xx, coordinate_t yy, size_t begin, size_t end, std::span<pixel_t> line) {
+		constexpr auto full_pixel_width = static_cast<int>(background_plane::full_pixel_width);
+		for (size_t x = begin; x < end;) {
+			auto [tile_index, palette_index] = plane.get_index(xx, yy);
+			auto palette_bits = static_cast<pattern::packed_row_t>(palette_index % background_plane::num_palettes) << pattern::bits_per_pixel;
+			auto row = std::bit_cast<pattern::row_t>(table.get_pattern(tile_index).packed_row(yy) | (palette_bits * 0x0101010101010101ULL));
+			auto fine_x = xx % pattern::width;
+			auto span = std::min(pattern::width - fine_x, end - x);
+			std::copy_n(&row[fine_x], span, &line[x]);
+			x += span;
+			xx = (xx + span) % full_pixel_width;
+		}
+	}
+
+	// drawn back to front, the main background the only layer until others are enabled
+	void sort_layers() {
+		_num_layers = 0;
+		_layer_order[_num_layers++] = 0;
+		for (size_t i = 0; i < _background_layers.size(); ++i) {
+			if (_background_layers[i].enabled) _layer_order[_num_layers++] = static_cast<uint8_t>(i + 1);
+		}
+		std::stable_sort(_layer_order.begin(), _layer_order.begin() + _num_layers, [this](auto a, auto b) {
+			auto pa = (a == 0) ? _background_priority : _background_layers[a - 1].priority;
+			auto pb = (b == 0) ? _background_priority : _background_layers[b - 1].priority;
+			return (pa != pb) ? (pa < pb) : (a > b);
+		});
+	}
+
+	bool is_layer_transparent(size_t layer) const {
+		return (layer == 0) ? _background_transparent : _background_layers[layer - 1].transparent;
+	}
+
+	// palette index above the pattern bits, as in a background scanline
+	pixel_t get_layer_pixel(const background_plane &plane, coordinate_t xx, coordinate_t yy) const {
+		auto [tile_index, palette_index] = plane.get_index(xx, yy);
+		auto pixel = get_pattern_table(plane.pattern_table_index).get_pixel(tile_index, xx, yy);
+		return static_cast<pixel_t>(((palette_index % background_plane::num_palettes) << pattern::bits_per_pixel) | pixel);
+	}
+
+	pixel_t get_background_pixel(coordinate_t x, coordinate_t y) const {
+		constexpr auto full_pixel_width = static_cast<int>(background_plane::full_pixel_width);
+		constexpr auto full_pixel_height = static_cast<int>(background_plane::full_pixel_height);
+
+		pixel_t pixel = 0;
+		for (size_t i = _num_layers; i-- > 0;) {
+			auto layer = _layer_order[i];
+			auto &plane = (layer == 0) ? _background_plane : _background_layers[layer - 1].plane;
+			auto xx = (x + ((layer == 0) ? scroll_x : _background_layers[layer - 1].scroll_x) % full_pixel_width) % full_pixel_width;
+			auto yy = (y + ((layer == 0) ? scroll_y : _background_layers[layer - 1].scroll_y) % full_pixel_height) % full_pixel_height;
+			if (xx < 0) xx += full_pixel_width;
+			if (yy < 0) yy += full_pixel_height;
+			pixel = get_layer_pixel(plane, xx, yy);
+			if (((pixel & pattern::pixel_mask) > 0) || !is_layer_transparent(layer)) break;
+		}
+		return pixel;
+	}
+
+	// every layer decoded back to front into the background line, in one pass per layer
+	void render_layers_scanline(coordinate_t y, size_t begin, size_t end, scanline_buffers &buffers) const {
+		constexpr auto full_pixel_width = static_cast<int>(background_plane::full_pixel_width);
+		constexpr auto full_pixel_height = static_cast<int>(background_plane::full_pixel_height);
+
+		for (size_t i = 0; i < _num_layers; ++i) {
+			auto layer = _layer_order[i];
+			auto &line = (i == 0) ? buffers.background_line : buffers.layer_line;
+			if (layer == 0) {
+				render_background_scanline(y, begin, end, buffers.state, line);
+			} else {
+				auto &it = _background_layers[layer - 1];
+				auto xx = (it.scroll_x % full_pixel_width) + static_cast<coordinate_t>(begin % full_pixel_width);
+				auto yy = y + (it.scroll_y % full_pixel_height);
+				if (xx < 0) xx += full_pixel_width;
+				if (yy < 0) yy += full_pixel_height;
+				decode_background_row(it.plane, get_pattern_table(it.plane.pattern_table_index, buffers.state.banks), xx % full_pixel_width, yy % full_pixel_height, begin, end, line);
+			}
+			if (i == 0) continue;
+
+			auto transparent = is_layer_transparent(layer);
+			for (size_t x = begin; x < end; ++x) {
+				auto pixel = buffers.layer_line[x];
+				if (!transparent || ((pixel & pattern::pixel_mask) > 0)) buffers.background_line[x] = pixel;
+			}
+		}
+	}
+
 	sprite_plane _sprite_plane{};
 	background_plane _background_plane{};
+	std::array<background_layer, max_background_layers - 1> _background_layers{};
+	std::array<uint8_t, max_background_layers> _layer_order{};
+	size_t _num_layers = 1;
+	int _background_priority = 0;
+	bool _background_transparent = true;
 	color_t _background_color = 0;
-	std::array<pattern_table, num_pattern_tables> _pattern_tables{};
+	std::vector<pattern> _pattern_pool = std::vector<pattern>(pattern_banks::num_windows * pattern_table::bank_size);
+	pattern_banks _pattern_banks;
 
 	coordinate_t scroll_x = 0;
 	coordinate_t scroll_y = 0;
 
 	callback _callback;
 	attribute_t _attribute = 0;
+	raster_log _raster_log;
+
+	std::array<background_cache, num_pattern_tables> _background_caches;
+	bool _background_cache_enabled = false;
+	pattern_banks _cache_banks;
+
+	bool _palette_indirect = false;
+	bool _colors_dirty = false;
+
+	bool _collision_detection = false;
+	collision_report _collisions;
+
+	bool _incremental = false;
+	bool _frame_dirty = true;
+	bool _frame_indirect = false;
+	size_t _frame_width = 0;
+	size_t _frame_height = 0;
+	const color_t *_frame_data = nullptr;
+	size_t _frame_size = 0;
+	size_t _cell_width = 0;
+	size_t _cell_height = 0;
+	std::vector<uint8_t> _dirty_cells;
+	std::vector<rect> _dirty_rects;
+	std::vector<sprite_plane::scanline> _previous_sprite_scanlines;
+
+	render_path _render_path = render_path::automatic;
+	render_backend _render_backend = render_backend::optimized;
+	compose_kernel _compose_kernel = get_compose_kernel(render_path::automatic);
+
+	std::vector<sprite_plane::scanline> _sprite_scanlines;
+	bool _sprites_dirty = true;
+
+	std::vector<scanline_buffers> _band_buffers;
+	std::unique_ptr<worker_pool> _workers;
+};
+
+using picture_processing_unit = basic_picture_processing_unit<>;
+
+// single producer and single consumer, neither ever waits,
+// and the consumer always gets the newest published value
+template<typename T>
+class triple_buffer {
+public:
+	// written by the producer only
+	T &back() { return _buffers[_back]; }
+
+	void publish() {
+		_back = _middle.exchange(_back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+	}
+
+	// read by the consumer only
+	auto &front() const { return _buffers[_front]; }
+	auto &front() { return _buffers[_front]; }
+
+	bool fetch() {
+		if ((_middle.load(std::memory_order_relaxed) & fresh_bit) == 0) return false;
+		_front = _middle.exchange(_front, std::memory_order_acq_rel) & index_mask;
+		return true;
+	}
+
+private:
+	static constexpr uint8_t index_mask = 0b011;
+	static constexpr uint8_t fresh_bit = 0b100;
+
+	std::array<T, 3> _buffers{};
+	uint8_t _back = 0;
+	uint8_t _front = 1;
+	std::atomic<uint8_t> _middle{ 2 };
+};
+
+// renders frame N on its own thread while the caller updates frame N + 1,
+// callbacks never run on the render thread, so raster effects go through the raster log
+template<typename Profile = classic_profile>
+class basic_render_pipeline {
+public:
+	using ppu_type = basic_picture_processing_unit<Profile>;
+
+	basic_render_pipeline(size_t width, size_t height, size_t num_threads = 1) : _width(width), _height(height) {
+		_ppu.set_render_threads(num_threads);
+		_thread = std::thread([this] { work(); });
+	}
+
+	~basic_render_pipeline() {
+		_quit.store(true, std::memory_order_relaxed);
+		_submitted.fetch_add(1, std::memory_order_release);
+		_submitted.notify_one();
+		_thread.join();
+	}
+
+	basic_render_pipeline(const basic_render_pipeline &) = delete;
+	basic_render_pipeline &operator=(const basic_render_pipeline &) = delete;
+
+	// hands the current state to the render thread, an unrendered earlier state is dropped
+	void submit(const ppu_type &ppu) {
+		ppu.save(_snapshots.back());
+		_snapshots.publish();
+		_submitted.fetch_add(1, std::memory_order_release);
+		_submitted.notify_one();
+	}
+
+	// true when a newer frame than the last one fetched is ready
+	bool fetch() { return _frames.fetch(); }
+
+	// empty until the first frame is fetched
+	std::span<const color_t> frame() const { return _frames.front().pixels; }
+
+	// found while rendering the fetched frame, when the submitted state asked for them
+	auto &collisions() const { return _frames.front().collisions; }
+
+	auto width() const { return _width; }
+	auto height() const { return _height; }
+
+private:
+	void work() {
+		uint32_t seen = 0;
+		while (true) {
+			_submitted.wait(seen, std::memory_order_acquire);
+			seen = _submitted.load(std::memory_order_acquire);
+			if (_quit.load(std::memory_order_relaxed)) return;
+			if (!_snapshots.fetch()) continue;
+
+			auto &frame = _frames.back();
+			frame.pixels.resize(_width * _height);
+			_ppu.load(_snapshots.front());
+			_ppu.render(frame.pixels, _width, _height);
+			frame.collisions = _ppu.get_collisions();
+			_frames.publish();
+		}
+	}
+
+	size_t _width = 0;
+	size_t _height = 0;
+
+	struct rendered_frame {
+		std::vector<color_t> pixels;
+		collision_report collisions;
+	};
+
+	ppu_type _ppu;
+	triple_buffer<typename ppu_type::snapshot> _snapshots;
+	triple_buffer<rendered_frame> _frames;
+
+	std::atomic<uint32_t> _submitted{ 0 };
+	std::atomic<bool> _quit{ false };
+	std::thread _thread;
+};
+
+using render_pipeline = basic_render_pipeline<>;
+
+// keeps the name tables showing the part of a world_map around the scroll position,
+// writing only the tile columns and rows that scroll into view
+template<typename Profile = classic_profile>
+class basic_world_stream {
+public:
+	using ppu_type = basic_picture_processing_unit<Profile>;
+	using background_plane = typename ppu_type::background_plane;
+
+	// tile columns and rows the name tables hold
+	static constexpr coordinate_t columns = static_cast<coordinate_t>(tile_table::width * background_plane::width);
+	static constexpr coordinate_t rows = static_cast<coordinate_t>(tile_table::height * background_plane::height);
+
+	// columns kept loaded left of the screen, the rest of the ring is ahead of it,
+	// a ring narrower than the view, as with horizontal mirroring, streams rows only:
+	// it holds the first columns of the map and the view wraps across them
+	static constexpr coordinate_t view_columns = static_cast<coordinate_t>((Profile::width + pattern::width - 1) / pattern::width + 1);
+	static constexpr bool streams_columns = (view_columns <= columns);
+	static constexpr coordinate_t margin = streams_columns ? ((columns - view_columns) / 2) : 0;
+
+	// rows kept loaded above the screen, when the ring has room for them the top is
+	// block aligned so no attribute block is shared across the seam
+	static constexpr coordinate_t view_rows = static_cast<coordinate_t>((Profile::height + pattern::height - 1) / pattern::height + 1);
+	static constexpr coordinate_t row_margin = (rows > view_rows) ? ((rows - view_rows) / 2) : 0;
+
+	// the map has to outlive the stream, the next update loads the whole view
+	void set_map(const world_map *map) {
+		_map = map;
+		_loaded = false;
+	}
+
+	auto map() const { return _map; }
+
+	// scrolls the ppu to a world position in pixels, a world taller than the name tables
+	// shows one row twice while scrolled between rows and shares one attribute block
+	// at the seam on odd rows, as on the hardware
+	void update(ppu_type &ppu, coordinate_t x, coordinate_t y) {
+		if (!_map || (_map->width() == 0) || (_map->height() == 0)) return;
+
+		auto left = streams_columns ? (floor_div(x, pattern::width) - margin) : 0;
+		auto top = floor_div(y, pattern::height) - row_margin;
+		if (rows > view_rows) top = floor_div(top, block::height) * block::height;
+
+		if (!_loaded || (std::abs(left - _left) >= columns) || (std::abs(top - _top) >= rows)) {
+			for (auto column = left; column < left + columns; ++column) load_column(ppu, column, top);
+			_loaded = true;
+
+		} else {
+			// columns first at the new rows, then rows across the new columns
+			auto first = (left > _left) ? (_left + columns) : left;
+			auto last = (left > _left) ? (left + columns) : _left;
+			for (auto column = first; column < last; ++column) load_column(ppu, column, top);
+
+			first = (top > _top) ? (_top + rows) : top;
+			last = (top > _top) ? (top + rows) : _top;
+			for (auto row = first; row < last; ++row) load_row(ppu, left, row);
+		}
+		_left = left;
+		_top = top;
+
+		ppu.set_scroll(floor_mod(x, columns * pattern::width), floor_mod(y, rows * pattern::height));
+	}
+
+private:
+	static coordinate_t floor_div(coordinate_t value, coordinate_t divisor) {
+		return (value >= 0) ? (value / divisor) : -((-value + divisor - 1) / divisor);
+	}
+
+	static coordinate_t floor_mod(coordinate_t value, coordinate_t divisor) {
+		return value - floor_div(value, divisor) * divisor;
+	}
+
+	void load_column(ppu_type &ppu, coordinate_t column, coordinate_t top) {
+		for (coordinate_t i = 0; i < rows; ++i) {
+			std::tie(_tile_indices[i], _palette_indices[i]) = _map->get(column, top + i);
+		}
+		ppu.set_tile_column(floor_mod(column, columns), floor_mod(top, rows), std::span{ _tile_indices.data(), static_cast<size_t>(rows) }, std::span{ _palette_indices.data(), static_cast<size_t>(rows) });
+	}
+
+	void load_row(ppu_type &ppu, coordinate_t left, coordinate_t row) {
+		for (coordinate_t i = 0; i < columns; ++i) {
+			std::tie(_tile_indices[i], _palette_indices[i]) = _map->get(left + i, row);
+		}
+		ppu.set_tile_row(floor_mod(left, columns), floor_mod(row, rows), std::span{ _tile_indices.data(), static_cast<size_t>(columns) }, std::span{ _palette_indices.data(), static_cast<size_t>(columns) });
+	}
+
+	const world_map *_map = nullptr;
+	bool _loaded = false;
+	coordinate_t _left = 0;
+	coordinate_t _top = 0;
+
+	std::array<index_t, std::max(columns, rows)> _tile_indices{};
+	std::array<index_t, std::max(columns, rows)> _palette_indices{};
 };
 
-class runtime {
+using world_stream = basic_world_stream<>;
+
+template<typename Profile = classic_profile>
+class basic_runtime {
 public:
+	using profile = Profile;
+	using ppu_type = basic_picture_processing_unit<Profile>;
+
+	static constexpr size_t width = profile::width;
+	static constexpr size_t height = profile::height;
+
 public:
-	runtime() {}
+	basic_runtime() {}
 
 public:
 #define INSTALL_PPU_FN_EX(NAME, FN) template<typename... Args> auto NAME(Args&&... args) { return _ppu.FN(std::forward<Args>(args)...); }
 #define INSTALL_PPU_FN(NAME) INSTALL_PPU_FN_EX(NAME, NAME)
 
 	INSTALL_PPU_FN_EX(render_picture, render);
+	INSTALL_PPU_FN_EX(resolve_picture, resolve);
 
 	INSTALL_PPU_FN(write_pattern);
+	INSTALL_PPU_FN(write_pattern_bank);
+	INSTALL_PPU_FN(set_pattern_banks);
+	INSTALL_PPU_FN(map_pattern_bank);
 
 	INSTALL_PPU_FN(set_sprite);
+	INSTALL_PPU_FN(set_sprite_count);
+	INSTALL_PPU_FN(set_sprite_limit);
 	INSTALL_PPU_FN(set_sprite_palette);
 	INSTALL_PPU_FN(set_sprite_pattern_table);
 
@@ -638,9 +2696,37 @@ public:
 
 	INSTALL_PPU_FN(set_tile);
 	INSTALL_PPU_FN(set_tile_palette);
+	INSTALL_PPU_FN(set_tile_column);
+	INSTALL_PPU_FN(set_tile_row);
 
 	INSTALL_PPU_FN(set_scroll);
 
+	INSTALL_PPU_FN(set_layer);
+	INSTALL_PPU_FN(set_layer_scroll);
+	INSTALL_PPU_FN(set_layer_pattern_table);
+	INSTALL_PPU_FN(set_layer_tile);
+	INSTALL_PPU_FN(set_layer_tile_palette);
+
+	INSTALL_PPU_FN(record_raster_write);
+	INSTALL_PPU_FN(record_scroll);
+	INSTALL_PPU_FN(record_background_color);
+	INSTALL_PPU_FN(record_background_pattern_table);
+	INSTALL_PPU_FN(record_sprite_pattern_table);
+	INSTALL_PPU_FN(record_background_palette);
+	INSTALL_PPU_FN(record_sprite_palette);
+	INSTALL_PPU_FN(record_pattern_bank);
+	INSTALL_PPU_FN(clear_raster_log);
+
+	INSTALL_PPU_FN(set_render_path);
+	INSTALL_PPU_FN(set_render_backend);
+	INSTALL_PPU_FN(set_render_threads);
+	INSTALL_PPU_FN(set_background_cache);
+	INSTALL_PPU_FN(set_incremental);
+	INSTALL_PPU_FN(set_collision_detection);
+	INSTALL_PPU_FN(get_sprite_zero_hit);
+	INSTALL_PPU_FN(get_sprite_collision);
+	INSTALL_PPU_FN(get_render_path);
+
 #undef INSTALL_PPU_FN
 #undef INSTALL_PPU_FN_EX
 
@@ -648,7 +2734,9 @@ public:
 	auto &ppu() { return _ppu; }
 
 private:
-	picture_processing_unit _ppu;
+	ppu_type _ppu;
 };
 
+using runtime = basic_runtime<>;
+
 } // namespace expt8